@@ -0,0 +1,217 @@
+// End-to-end remap latency benchmark. Run against a private X server (see
+// bench_e2e): poses as a focused "Bench" client, starts xremap with a config
+// remapping control-a to control-b, presses control-a through XTest and times
+// how long the remapped b takes to show up in a second XRecord context.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/Xproto.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/record.h>
+#include <X11/extensions/XTest.h>
+
+#define TIMEOUT_NS 1000000000L
+
+typedef struct {
+    Display *record_conn;
+    XRecordContext ctx;
+    KeyCode target;
+    atomic_ulong seen_ns;
+} Observer;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void observe(XPointer user_data, XRecordInterceptData *data) {
+    Observer *obs = (Observer*)user_data;
+    if (data->category == XRecordFromServer) {
+        xEvent *ev = (xEvent*)data->data;
+        if (ev->u.u.type == KeyPress && ev->u.u.detail == obs->target) {
+            atomic_store(&obs->seen_ns, now_ns());
+        }
+    }
+    XRecordFreeData(data);
+}
+
+static void *observer_thread(void *user_data) {
+    Observer *obs = (Observer*)user_data;
+    XRecordEnableContext(obs->record_conn, obs->ctx, observe, (XPointer)obs);
+    return NULL;
+}
+
+// Maps a window with WM_CLASS Bench and publishes it the way an EWMH window
+// manager would, so xremap finds a client list and an active window.
+static Window pose_as_client(Display *d) {
+    Window root = DefaultRootWindow(d);
+    Window w = XCreateSimpleWindow(d, root, 0, 0, 100, 100, 0, 0, 0);
+    XClassHint hint = { "bench", "Bench" };
+    XSetClassHint(d, w, &hint);
+    XMapWindow(d, w);
+    XSync(d, False);
+    XSetInputFocus(d, w, RevertToPointerRoot, CurrentTime);
+    XChangeProperty(d, root, XInternAtom(d, "_NET_CLIENT_LIST", False), XA_WINDOW, 32, PropModeReplace, (unsigned char*)&w, 1);
+    XChangeProperty(d, root, XInternAtom(d, "_NET_ACTIVE_WINDOW", False), XA_WINDOW, 32, PropModeReplace, (unsigned char*)&w, 1);
+    XSync(d, False);
+    return w;
+}
+
+// Presses control-a and waits for the remapped press. Returns the latency in
+// ns, or -1 on timeout.
+static long remap_once(Display *d, Observer *obs, KeyCode control, KeyCode a) {
+    atomic_store(&obs->seen_ns, 0);
+    uint64_t start = now_ns();
+    XTestFakeKeyEvent(d, control, True, 0);
+    XTestFakeKeyEvent(d, a, True, 0);
+    XFlush(d);
+    long latency = -1;
+    for (;;) {
+        uint64_t seen = atomic_load(&obs->seen_ns);
+        if (seen != 0) {
+            latency = seen - start;
+            break;
+        }
+        if (now_ns() - start > TIMEOUT_NS) {
+            break;
+        }
+        sched_yield();
+    }
+    XTestFakeKeyEvent(d, a, False, 0);
+    XTestFakeKeyEvent(d, control, False, 0);
+    XSync(d, False);
+    return latency;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [-n <iterations>] [-o <xremap log>] <xremap> [xremap args...]\n", program_name);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 5000;
+    const char *log_path = "/dev/null";
+    int ch;
+    while ((ch = getopt(argc, argv, "+n:o:")) != -1) {
+        switch (ch) {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'o':
+                log_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || iterations <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!XInitThreads()) {
+        fprintf(stderr, "Failed to initialize threads.\n");
+        return EXIT_FAILURE;
+    }
+    Display *d = XOpenDisplay(NULL);
+    Observer obs;
+    obs.record_conn = XOpenDisplay(NULL);
+    if (d == NULL || obs.record_conn == NULL) {
+        fprintf(stderr, "Unable to connect to X11 display. Is $DISPLAY set?\n");
+        return EXIT_FAILURE;
+    }
+    KeyCode control = XKeysymToKeycode(d, XK_Control_L);
+    KeyCode a = XKeysymToKeycode(d, XK_a);
+    obs.target = XKeysymToKeycode(d, XK_b);
+    atomic_init(&obs.seen_ns, 0);
+    pose_as_client(d);
+
+    XRecordRange *range = XRecordAllocRange();
+    XRecordClientSpec spec = XRecordAllClients;
+    range->device_events.first = KeyPress;
+    range->device_events.last = KeyPress;
+    obs.ctx = XRecordCreateContext(d, 0, &spec, 1, &range, 1);
+    XSync(d, False);
+    pthread_t observer;
+    pthread_create(&observer, NULL, observer_thread, &obs);
+
+    pid_t xremap = fork();
+    if (xremap == 0) {
+        freopen(log_path, "w", stderr);
+        execv(argv[optind], argv + optind);
+        perror("execv");
+        _exit(127);
+    }
+
+    // wait for xremap to grab
+    long latency = -1;
+    for (int i = 0; i < 50 && latency < 0; i++) {
+        latency = remap_once(d, &obs, control, a);
+    }
+    if (latency < 0) {
+        fprintf(stderr, "xremap never remapped control-a\n");
+        kill(xremap, SIGTERM);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < iterations / 10; i++) {
+        remap_once(d, &obs, control, a);
+    }
+
+    long *samples = malloc(iterations * sizeof(long));
+    int n = 0, timeouts = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        latency = remap_once(d, &obs, control, a);
+        if (latency < 0) {
+            timeouts++;
+        } else {
+            samples[n++] = latency;
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    // latency histograms of xremap itself land in its log
+    kill(xremap, SIGUSR1);
+    usleep(100000);
+    kill(xremap, SIGTERM);
+    waitpid(xremap, NULL, 0);
+    XRecordDisableContext(d, obs.ctx);
+    XSync(d, False);
+    pthread_join(observer, NULL);
+    XRecordFreeContext(d, obs.ctx);
+
+    if (n == 0) {
+        fprintf(stderr, "no remap observed\n");
+        return EXIT_FAILURE;
+    }
+    qsort(samples, n, sizeof(long), compare_long);
+    printf("remaps %d  timeouts %d  %.0f remaps/s  %.0f events/s\n", n, timeouts, n / seconds, 4 * n / seconds);
+    printf("latency us  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+            samples[n / 2] / 1000.0, samples[n * 90 / 100] / 1000.0, samples[n * 99 / 100] / 1000.0,
+            samples[n * 999 / 1000] / 1000.0, samples[n - 1] / 1000.0);
+
+    free(samples);
+    XFree(range);
+    XCloseDisplay(obs.record_conn);
+    XCloseDisplay(d);
+    return timeouts == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
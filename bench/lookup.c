@@ -0,0 +1,210 @@
+// Headless benchmark of hotkey resolution. Builds synthetic configs of
+// growing size, compiles them and drives random (modifiers, keycode, class)
+// lookups through mapping_execute with a mock backend, next to the two-level
+// khash lookup the config is stored in. Reports ns/lookup and, when the
+// kernel lets us count them, cache misses per lookup.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mapping.h"
+
+#define NPROBES 4096
+
+typedef struct {
+    int class_id;
+    unsigned long injected;
+} MockBackend;
+
+static int mock_focus_class_id(void *ctx) {
+    return ((MockBackend*)ctx)->class_id;
+}
+
+static void mock_inject(void *ctx, const Target *target) {
+    ((MockBackend*)ctx)->injected += target->to.key;
+}
+
+typedef struct {
+    Hotkey key;
+    int class_id;
+    const char *class;
+} Probe;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int open_cache_miss_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counter_start(int fd) {
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static long counter_stop(int fd) {
+    long long count = -1;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = -1;
+        }
+    }
+    return count;
+}
+
+// nbindings random source hotkeys, each remapped globally or for a few of
+// nclasses classes.
+static khash_t(Config) *make_config(int nbindings, int nclasses, char **classes) {
+    khash_t(Config) *config = kh_init(Config);
+    while (kh_size(config) < (khint_t)nbindings) {
+        Hotkey from = { rand() & 0xFF, 8 + rand() % 248, 0 };
+        int ret;
+        khint_t k = kh_put(Config, config, hotkey_to_int(from), &ret);
+        if (ret == 0) {
+            continue;
+        }
+        khash_t(Mappings) *mapping = kh_init(Mappings);
+        kh_value(config, k) = mapping;
+        int ntargets = rand() % 4 == 0 ? 1 : 1 + rand() % 4;
+        for (int i = 0; i < ntargets; i++) {
+            const char *class = i == 0 && ntargets == 1 ? "*" : classes[rand() % nclasses];
+            khint_t k2 = kh_put(Mappings, mapping, class, &ret);
+            if (ret != 0) {
+                Hotkey *to = new_hotkey();
+                to->key = 8 + rand() % 248;
+                kh_value(mapping, k2) = to;
+            }
+        }
+    }
+    return config;
+}
+
+// Unlike free_config the hotkeys here are malloc'ed, not in an arena.
+static void free_bench_config(khash_t(Config) *config) {
+    for (khint_t k = kh_begin(config); k != kh_end(config); ++k) {
+        if (kh_exist(config, k)) {
+            khash_t(Mappings) *mapping = kh_value(config, k);
+            for (khint_t k2 = kh_begin(mapping); k2 != kh_end(mapping); ++k2) {
+                if (kh_exist(mapping, k2)) {
+                    free(kh_value(mapping, k2));
+                }
+            }
+            kh_destroy(Mappings, mapping);
+        }
+    }
+    kh_destroy(Config, config);
+}
+
+// Half of the probes hit a configured hotkey, the rest are random keys.
+static void make_probes(Probe *probes, khash_t(Config) *config, const Dispatch *dispatch, int nclasses, char **classes) {
+    unsigned int *keys = malloc(kh_size(config) * sizeof(unsigned int));
+    int nkeys = 0;
+    for (khint_t k = kh_begin(config); k != kh_end(config); ++k) {
+        if (kh_exist(config, k)) keys[nkeys++] = kh_key(config, k);
+    }
+    for (int i = 0; i < NPROBES; i++) {
+        if (rand() % 2) {
+            Hotkey *h = int_to_hotkey(keys[rand() % nkeys]);
+            probes[i].key = *h;
+            free(h);
+        } else {
+            probes[i].key = (Hotkey){ rand() & 0xFF, 8 + rand() % 248, 0 };
+        }
+        probes[i].class = classes[rand() % nclasses];
+        probes[i].class_id = dispatch_class_id(dispatch, probes[i].class);
+    }
+    free(keys);
+}
+
+static void report(const char *name, int nbindings, long iterations, uint64_t ns, long misses, unsigned long sink) {
+    printf("%-8s %6d bindings  %7.2f ns/lookup", name, nbindings, (double)ns / iterations);
+    if (misses >= 0) {
+        printf("  %7.4f cache misses/lookup", (double)misses / iterations);
+    } else {
+        printf("  cache misses n/a");
+    }
+    printf("  (%lu)\n", sink);
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+    const int sizes[] = { 16, 256, 4096, 32768 };
+    const int nclasses = 64;
+    char *classes[64];
+    for (int i = 0; i < nclasses; i++) {
+        classes[i] = malloc(32);
+        snprintf(classes[i], 32, "Class%d", i);
+    }
+    int counter = open_cache_miss_counter();
+    Probe *probes = malloc(NPROBES * sizeof(Probe));
+    srand(1);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        khash_t(Config) *config = make_config(sizes[s], nclasses, classes);
+        Dispatch *dispatch = compile_dispatch(config);
+        make_probes(probes, config, dispatch, nclasses, classes);
+
+        MockBackend mock = { DISPATCH_NO_CLASS, 0 };
+        MappingBackend backend = { &mock, mock_focus_class_id, mock_inject };
+        counter_start(counter);
+        uint64_t start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            const Probe *p = &probes[i & (NPROBES - 1)];
+            mock.class_id = p->class_id;
+            mapping_execute(dispatch, &p->key, &backend);
+        }
+        uint64_t ns = now_ns() - start;
+        report("dispatch", sizes[s], iterations, ns, counter_stop(counter), mock.injected);
+
+        // the lookup main4.c did before the dispatch table
+        unsigned long found = 0;
+        counter_start(counter);
+        start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            const Probe *p = &probes[i & (NPROBES - 1)];
+            khint_t k = kh_get(Config, config, hotkey_to_int(p->key));
+            if (k == kh_end(config)) {
+                continue;
+            }
+            khash_t(Mappings) *mapping = kh_value(config, k);
+            khint_t k2 = kh_get(Mappings, mapping, "*");
+            if (k2 == kh_end(mapping)) {
+                k2 = kh_get(Mappings, mapping, p->class);
+            }
+            if (k2 != kh_end(mapping)) {
+                found += kh_value(mapping, k2)->key;
+            }
+        }
+        ns = now_ns() - start;
+        report("khash", sizes[s], iterations, ns, counter_stop(counter), found);
+
+        free_dispatch(dispatch);
+        free_bench_config(config);
+    }
+
+    if (counter >= 0) close(counter);
+    free(probes);
+    for (int i = 0; i < nclasses; i++) free(classes[i]);
+    return EXIT_SUCCESS;
+}
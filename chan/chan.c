@@ -49,6 +49,25 @@ static int unbuffered_chan_recv(chan_t* chan, void** data);
 static int chan_can_recv(chan_t* chan);
 static int chan_can_send(chan_t* chan);
 static int chan_is_buffered(chan_t* chan);
+static int chan_is_lockfree(chan_t* chan);
+static void chan_notify_selectors(chan_t* chan);
+static void chan_notify_selectors_lockfree(chan_t* chan);
+
+// A thread sleeping in chan_select_wait. It is linked into the waiter list of
+// every channel it selects on, with one select_link_t per channel.
+typedef struct select_waiter_t
+{
+    pthread_mutex_t mu;
+    pthread_cond_t  cond;
+    int             ready;
+} select_waiter_t;
+
+typedef struct select_link_t
+{
+    select_waiter_t*      waiter;
+    struct select_link_t* prev;
+    struct select_link_t* next;
+} select_link_t;
 
 void current_utc_time(struct timespec *ts) {
 #ifdef __MACH__ 
@@ -96,6 +115,44 @@ chan_t* chan_init(size_t capacity)
     return chan;
 }
 
+// Allocates and returns a new buffered channel backed by a lock-free queue
+// instead of a mutex-guarded one. Sends and receives only sleep, on a futex,
+// while the channel is full or empty. The capacity must be greater than 0 and
+// is rounded up to a power of two. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_lockfree(size_t capacity)
+{
+    if (capacity == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    chan_t* chan = (chan_t*) malloc(sizeof(chan_t));
+    if (!chan)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mpmc_t* lf_queue = mpmc_init(capacity);
+    if (!lf_queue)
+    {
+        free(chan);
+        return NULL;
+    }
+
+    if (unbuffered_chan_init(chan) != 0)
+    {
+        mpmc_dispose(lf_queue);
+        free(chan);
+        return NULL;
+    }
+
+    chan->lf_queue = lf_queue;
+    return chan;
+}
+
 static int buffered_chan_init(chan_t* chan, size_t capacity)
 {
     queue_t* queue = queue_init(capacity);
@@ -154,7 +211,10 @@ static int unbuffered_chan_init(chan_t* chan)
     chan->closed = 0;
     chan->r_waiting = 0;
     chan->w_waiting = 0;
+    chan->select_links = NULL;
+    atomic_init(&chan->select_waiting, 0);
     chan->queue = NULL;
+    chan->lf_queue = NULL;
     chan->data = NULL;
     return 0;
 }
@@ -166,6 +226,10 @@ void chan_dispose(chan_t* chan)
     {
         queue_dispose(chan->queue);
     }
+    else if (chan_is_lockfree(chan))
+    {
+        mpmc_dispose(chan->lf_queue);
+    }
 
     pthread_mutex_destroy(&chan->w_mu);
     pthread_mutex_destroy(&chan->r_mu);
@@ -184,6 +248,16 @@ void chan_dispose(chan_t* chan)
 // successfully closed, -1 otherwise. If -1 is returned, errno will be set.
 int chan_close(chan_t* chan)
 {
+    if (chan_is_lockfree(chan))
+    {
+        if (mpmc_close(chan->lf_queue) != 0)
+        {
+            return -1;
+        }
+        chan_notify_selectors_lockfree(chan);
+        return 0;
+    }
+
     int success = 0;
     pthread_mutex_lock(&chan->m_mu);
     if (chan->closed)
@@ -198,6 +272,7 @@ int chan_close(chan_t* chan)
         chan->closed = 1;
         pthread_cond_broadcast(&chan->r_cond);
         pthread_cond_broadcast(&chan->w_cond);
+        chan_notify_selectors(chan);
     }
     pthread_mutex_unlock(&chan->m_mu);
     return success;
@@ -206,6 +281,11 @@ int chan_close(chan_t* chan)
 // Returns 0 if the channel is open and 1 if it is closed.
 int chan_is_closed(chan_t* chan)
 {
+    if (chan_is_lockfree(chan))
+    {
+        return mpmc_is_closed(chan->lf_queue);
+    }
+
     pthread_mutex_lock(&chan->m_mu);
     int closed = chan->closed;
     pthread_mutex_unlock(&chan->m_mu);
@@ -225,6 +305,13 @@ int chan_send(chan_t* chan, void* data)
         return -1;
     }
 
+    if (chan_is_lockfree(chan))
+    {
+        int success = mpmc_add(chan->lf_queue, data);
+        chan_notify_selectors_lockfree(chan);
+        return success;
+    }
+
     return chan_is_buffered(chan) ?
         buffered_chan_send(chan, data) :
         unbuffered_chan_send(chan, data);
@@ -235,6 +322,13 @@ int chan_send(chan_t* chan, void* data)
 // returned, errno will be set.
 int chan_recv(chan_t* chan, void** data)
 {
+    if (chan_is_lockfree(chan))
+    {
+        int success = mpmc_remove(chan->lf_queue, data);
+        chan_notify_selectors_lockfree(chan);
+        return success;
+    }
+
     return chan_is_buffered(chan) ?
         buffered_chan_recv(chan, data) :
         unbuffered_chan_recv(chan, data);
@@ -258,6 +352,7 @@ static int buffered_chan_send(chan_t* chan, void* data)
         // Signal waiting reader.
         pthread_cond_signal(&chan->r_cond);
     }
+    chan_notify_selectors(chan);
 
     pthread_mutex_unlock(&chan->m_mu);
     return success;
@@ -292,6 +387,7 @@ static int buffered_chan_recv(chan_t* chan, void** data)
         // Signal waiting writer.
         pthread_cond_signal(&chan->w_cond);
     }
+    chan_notify_selectors(chan);
 
     pthread_mutex_unlock(&chan->m_mu);
     return 0;
@@ -318,6 +414,7 @@ static int unbuffered_chan_send(chan_t* chan, void* data)
         // Signal waiting reader.
         pthread_cond_signal(&chan->r_cond);
     }
+    chan_notify_selectors(chan);
 
     // Block until reader consumed chan->data.
     pthread_cond_wait(&chan->w_cond, &chan->m_mu);
@@ -334,8 +431,10 @@ static int unbuffered_chan_recv(chan_t* chan, void** data)
 
     while (!chan->closed && !chan->w_waiting)
     {
-        // Block until writer has set chan->data.
+        // Block until writer has set chan->data. A selecting writer can
+        // proceed now.
         chan->r_waiting++;
+        chan_notify_selectors(chan);
         pthread_cond_wait(&chan->r_cond, &chan->m_mu);
         chan->r_waiting--;
     }
@@ -363,11 +462,16 @@ static int unbuffered_chan_recv(chan_t* chan, void** data)
 }
 
 // Returns the number of items in the channel buffer. If the channel is
-// unbuffered, this will return 0.
+// unbuffered, this will return 0. For a lock-free channel the count is
+// approximate, see mpmc_size.
 int chan_size(chan_t* chan)
 {
     int size = 0;
-    if (chan_is_buffered(chan))
+    if (chan_is_lockfree(chan))
+    {
+        size = mpmc_size(chan->lf_queue);
+    }
+    else if (chan_is_buffered(chan))
     {
         pthread_mutex_lock(&chan->m_mu);
         size = chan->queue->size;
@@ -384,6 +488,27 @@ typedef struct
     int     index;
 } select_op_t;
 
+// Returns the next value of a per-thread xorshift generator, seeded from the
+// clock on first use. Only used to pick fairly between ready operations.
+static uint32_t select_rand()
+{
+    static _Thread_local uint32_t state = 0;
+    if (state == 0)
+    {
+        struct timespec ts;
+        current_utc_time(&ts);
+        state = (uint32_t) ts.tv_nsec ^ (uint32_t) (uintptr_t) &ts;
+        if (state == 0)
+        {
+            state = 0x9E3779B9;
+        }
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
 // A select statement chooses which of a set of possible send or receive
 // operations will proceed. The return value indicates which channel's
 // operation has proceeded. If more than one operation can proceed, one is
@@ -394,8 +519,6 @@ typedef struct
 int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
     chan_t* send_chans[], int send_count, void* send_msgs[])
 {
-    // TODO: Add support for blocking selects.
-
     select_op_t candidates[recv_count + send_count];
     int count = 0;
     int i;
@@ -434,13 +557,8 @@ int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
         return -1;
     }
 
-    // Seed rand using current time in nanoseconds.
-    struct timespec ts;
-    current_utc_time(&ts);
-    srand(ts.tv_nsec);
-
     // Select candidate and perform operation.
-    select_op_t select = candidates[rand() % count];
+    select_op_t select = candidates[select_rand() % count];
     if (select.recv && chan_recv(select.chan, recv_out) != 0)
     {
         return -1;
@@ -453,9 +571,171 @@ int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
     return select.index;
 }
 
+// Wakes every thread selecting on the channel. Must be called with m_mu held.
+static void chan_notify_selectors(chan_t* chan)
+{
+    for (select_link_t* link = chan->select_links; link; link = link->next)
+    {
+        select_waiter_t* waiter = link->waiter;
+        pthread_mutex_lock(&waiter->mu);
+        waiter->ready = 1;
+        pthread_cond_signal(&waiter->cond);
+        pthread_mutex_unlock(&waiter->mu);
+    }
+}
+
+// Wakes every thread selecting on a lock-free channel. Only takes m_mu when
+// somebody is selecting.
+static void chan_notify_selectors_lockfree(chan_t* chan)
+{
+    if (atomic_load(&chan->select_waiting) > 0)
+    {
+        pthread_mutex_lock(&chan->m_mu);
+        chan_notify_selectors(chan);
+        pthread_mutex_unlock(&chan->m_mu);
+    }
+}
+
+static void chan_add_selector(chan_t* chan, select_link_t* link)
+{
+    pthread_mutex_lock(&chan->m_mu);
+    link->prev = NULL;
+    link->next = chan->select_links;
+    if (chan->select_links)
+    {
+        chan->select_links->prev = link;
+    }
+    chan->select_links = link;
+    atomic_fetch_add(&chan->select_waiting, 1);
+    pthread_mutex_unlock(&chan->m_mu);
+}
+
+static void chan_remove_selector(chan_t* chan, select_link_t* link)
+{
+    pthread_mutex_lock(&chan->m_mu);
+    if (link->prev)
+    {
+        link->prev->next = link->next;
+    }
+    else
+    {
+        chan->select_links = link->next;
+    }
+    if (link->next)
+    {
+        link->next->prev = link->prev;
+    }
+    atomic_fetch_sub(&chan->select_waiting, 1);
+    pthread_mutex_unlock(&chan->m_mu);
+}
+
+// Like chan_select, but blocks until one of the operations can proceed. The
+// calling thread registers on every channel's waiter list and sleeps once
+// until any of them changes state. A NULL timeout blocks indefinitely,
+// otherwise -1 is returned with errno set to ETIMEDOUT once the relative
+// timeout expires. Closed channels never become ready; if all of them are
+// closed, -1 is returned with errno set to EPIPE. Two threads selecting on
+// opposite ends of the same unbuffered channel do not see each other.
+int chan_select_wait(chan_t* recv_chans[], int recv_count, void** recv_out,
+    chan_t* send_chans[], int send_count, void* send_msgs[],
+    const struct timespec* timeout)
+{
+    int index = chan_select(recv_chans, recv_count, recv_out,
+        send_chans, send_count, send_msgs);
+    if (index >= 0 || (timeout && timeout->tv_sec == 0 && timeout->tv_nsec == 0))
+    {
+        if (index < 0)
+        {
+            errno = ETIMEDOUT;
+        }
+        return index;
+    }
+
+    struct timespec deadline;
+    if (timeout)
+    {
+        current_utc_time(&deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    select_waiter_t waiter;
+    pthread_mutex_init(&waiter.mu, NULL);
+    pthread_cond_init(&waiter.cond, NULL);
+    waiter.ready = 0;
+
+    int total = recv_count + send_count;
+    select_link_t links[total];
+    for (int i = 0; i < total; i++)
+    {
+        links[i].waiter = &waiter;
+        chan_add_selector(i < recv_count ? recv_chans[i] : send_chans[i - recv_count], &links[i]);
+    }
+
+    int timed_out = 0;
+    for (;;)
+    {
+        // Clear before polling, so any change after the poll wakes us.
+        pthread_mutex_lock(&waiter.mu);
+        waiter.ready = 0;
+        pthread_mutex_unlock(&waiter.mu);
+
+        index = chan_select(recv_chans, recv_count, recv_out,
+            send_chans, send_count, send_msgs);
+        if (index >= 0 || timed_out)
+        {
+            break;
+        }
+
+        int open = 0;
+        for (int i = 0; i < total && !open; i++)
+        {
+            open = !chan_is_closed(i < recv_count ? recv_chans[i] : send_chans[i - recv_count]);
+        }
+        if (!open)
+        {
+            errno = EPIPE;
+            break;
+        }
+
+        pthread_mutex_lock(&waiter.mu);
+        while (!waiter.ready && !timed_out)
+        {
+            if (!timeout)
+            {
+                pthread_cond_wait(&waiter.cond, &waiter.mu);
+            }
+            else if (pthread_cond_timedwait(&waiter.cond, &waiter.mu, &deadline) == ETIMEDOUT)
+            {
+                // Poll once more before giving up.
+                timed_out = 1;
+            }
+        }
+        pthread_mutex_unlock(&waiter.mu);
+    }
+
+    for (int i = 0; i < total; i++)
+    {
+        chan_remove_selector(i < recv_count ? recv_chans[i] : send_chans[i - recv_count], &links[i]);
+    }
+    pthread_mutex_destroy(&waiter.mu);
+    pthread_cond_destroy(&waiter.cond);
+
+    if (index < 0 && timed_out)
+    {
+        errno = ETIMEDOUT;
+    }
+    return index;
+}
+
 static int chan_can_recv(chan_t* chan)
 {
-    if (chan_is_buffered(chan))
+    if (chan_is_buffered(chan) || chan_is_lockfree(chan))
     {
         return chan_size(chan) > 0;
     }
@@ -469,7 +749,11 @@ static int chan_can_recv(chan_t* chan)
 static int chan_can_send(chan_t* chan)
 {
     int send;
-    if (chan_is_buffered(chan))
+    if (chan_is_lockfree(chan))
+    {
+        send = chan_size(chan) < (int) chan->lf_queue->capacity;
+    }
+    else if (chan_is_buffered(chan))
     {
         // Can send if buffered channel is not full.
         pthread_mutex_lock(&chan->m_mu);
@@ -492,6 +776,11 @@ static int chan_is_buffered(chan_t* chan)
     return chan->queue != NULL;
 }
 
+static int chan_is_lockfree(chan_t* chan)
+{
+    return chan->lf_queue != NULL;
+}
+
 int chan_send_int32(chan_t* chan, int32_t data)
 {
     int32_t* wrapped = malloc(sizeof(int32_t));
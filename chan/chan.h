@@ -2,9 +2,12 @@
 #define chan_h
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "queue.h"
+#include "mpmc.h"
 
 
 // Defines a thread-safe communication pipe. Channels are either buffered or
@@ -17,6 +20,9 @@ typedef struct chan_t
 {
     // Buffered channel properties
     queue_t*         queue;
+
+    // Lock-free buffered channel properties
+    mpmc_t*          lf_queue;
     
     // Unbuffered channel properties
     pthread_mutex_t  r_mu;
@@ -30,6 +36,12 @@ typedef struct chan_t
     int              closed;
     int              r_waiting;
     int              w_waiting;
+
+    // Threads blocked in chan_select_wait on this channel, guarded by m_mu.
+    // select_waiting mirrors the list length so lock-free channels can skip
+    // the mutex when nobody is selecting.
+    struct select_link_t* select_links;
+    atomic_int       select_waiting;
 } chan_t;
 
 // Allocates and returns a new channel. The capacity specifies whether the
@@ -37,6 +49,13 @@ typedef struct chan_t
 // channel. Sets errno and returns NULL if initialization failed.
 chan_t* chan_init(size_t capacity);
 
+// Allocates and returns a new buffered channel backed by a lock-free queue
+// instead of a mutex-guarded one. Sends and receives only sleep, on a futex,
+// while the channel is full or empty. The capacity must be greater than 0 and
+// is rounded up to a power of two. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_lockfree(size_t capacity);
+
 // Releases the channel resources.
 void chan_dispose(chan_t* chan);
 
@@ -62,7 +81,8 @@ int chan_send(chan_t* chan, void* data);
 int chan_recv(chan_t* chan, void** data);
 
 // Returns the number of items in the channel buffer. If the channel is
-// unbuffered, this will return 0.
+// unbuffered, this will return 0. For a lock-free channel the count is
+// approximate, see mpmc_size.
 int chan_size(chan_t* chan);
 
 // A select statement chooses which of a set of possible send or receive
@@ -75,6 +95,17 @@ int chan_size(chan_t* chan);
 int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
     chan_t* send_chans[], int send_count, void* send_msgs[]);
 
+// Like chan_select, but blocks until one of the operations can proceed. The
+// calling thread registers on every channel's waiter list and sleeps once
+// until any of them changes state. A NULL timeout blocks indefinitely,
+// otherwise -1 is returned with errno set to ETIMEDOUT once the relative
+// timeout expires. Closed channels never become ready; if all of them are
+// closed, -1 is returned with errno set to EPIPE. Two threads selecting on
+// opposite ends of the same unbuffered channel do not see each other.
+int chan_select_wait(chan_t* recv_chans[], int recv_count, void** recv_out,
+    chan_t* send_chans[], int send_count, void* send_msgs[],
+    const struct timespec* timeout);
+
 // Typed interface to send/recv chan.
 int chan_send_int32(chan_t*, int32_t);
 int chan_send_int64(chan_t*, int64_t);
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "mpmc.h"
+
+// Sleeps while *word still equals expected. Spurious returns are fine, the
+// callers recheck the queue.
+static void wait_word(atomic_uint* word, unsigned int expected)
+{
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+#else
+    if (atomic_load(word) == expected)
+    {
+        sched_yield();
+    }
+#endif
+}
+
+// Wakes up to count threads sleeping on word.
+static void wake_word(atomic_uint* word, int count)
+{
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#else
+    (void) word;
+    (void) count;
+#endif
+}
+
+// Allocates and returns a new queue. The capacity is rounded up to a power of
+// two. Sets errno and returns NULL if initialization failed.
+mpmc_t* mpmc_init(size_t capacity)
+{
+    if (capacity == 0 || capacity > INT_MAX / sizeof(mpmc_cell_t))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t rounded = 2;
+    while (rounded < capacity)
+    {
+        rounded <<= 1;
+    }
+
+    mpmc_t* queue = NULL;
+    if (posix_memalign((void**) &queue, MPMC_CACHE_LINE, sizeof(mpmc_t)) != 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    queue->cells = (mpmc_cell_t*) malloc(rounded * sizeof(mpmc_cell_t));
+    if (!queue->cells)
+    {
+        free(queue);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < rounded; i++)
+    {
+        atomic_init(&queue->cells[i].seq, i);
+        queue->cells[i].data = NULL;
+    }
+
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->items, 0);
+    atomic_init(&queue->items_waiting, 0);
+    atomic_init(&queue->space, 0);
+    atomic_init(&queue->space_waiting, 0);
+    atomic_init(&queue->closed, 0);
+    queue->capacity = rounded;
+    queue->mask = rounded - 1;
+    return queue;
+}
+
+// Releases the queue resources.
+void mpmc_dispose(mpmc_t* queue)
+{
+    free(queue->cells);
+    free(queue);
+}
+
+// Enqueues an item without blocking. Returns 0 if the add succeeded or -1 if
+// the queue is full or closed. If -1 is returned, errno will be set.
+int mpmc_try_add(mpmc_t* queue, void* value)
+{
+    if (atomic_load_explicit(&queue->closed, memory_order_relaxed))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    mpmc_cell_t* cell;
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Slot still holds the item from one lap ago.
+            errno = ENOBUFS;
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->data = value;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add(&queue->items, 1);
+    if (atomic_load(&queue->items_waiting) > 0)
+    {
+        wake_word(&queue->items, 1);
+    }
+    return 0;
+}
+
+// Dequeues an item without blocking. Returns 0 if an item was removed or -1
+// if the queue is empty.
+int mpmc_try_remove(mpmc_t* queue, void** value)
+{
+    mpmc_cell_t* cell;
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Slot not written yet.
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    if (value)
+    {
+        *value = cell->data;
+    }
+    atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+
+    atomic_fetch_add(&queue->space, 1);
+    if (atomic_load(&queue->space_waiting) > 0)
+    {
+        wake_word(&queue->space, 1);
+    }
+    return 0;
+}
+
+// Enqueues an item, blocking while the queue is full. Returns 0 if the add
+// succeeded or -1 if the queue is closed. If -1 is returned, errno will be
+// set.
+int mpmc_add(mpmc_t* queue, void* value)
+{
+    for (;;)
+    {
+        // Read the wait word before trying, so a remove that happens after
+        // the failed try makes the wait return immediately.
+        unsigned int space = atomic_load(&queue->space);
+        if (mpmc_try_add(queue, value) == 0)
+        {
+            return 0;
+        }
+        if (errno == EPIPE)
+        {
+            return -1;
+        }
+
+        atomic_fetch_add(&queue->space_waiting, 1);
+        if (mpmc_size(queue) >= (int) queue->capacity && !mpmc_is_closed(queue))
+        {
+            wait_word(&queue->space, space);
+        }
+        atomic_fetch_sub(&queue->space_waiting, 1);
+    }
+}
+
+// Dequeues an item, blocking while the queue is empty. Returns 0 if an item
+// was removed or -1 once the queue is closed and empty. If -1 is returned,
+// errno will be set.
+int mpmc_remove(mpmc_t* queue, void** value)
+{
+    for (;;)
+    {
+        unsigned int items = atomic_load(&queue->items);
+        if (mpmc_try_remove(queue, value) == 0)
+        {
+            return 0;
+        }
+        if (mpmc_is_closed(queue))
+        {
+            // Recheck, an add may have landed before the close.
+            if (mpmc_try_remove(queue, value) == 0)
+            {
+                return 0;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+
+        atomic_fetch_add(&queue->items_waiting, 1);
+        if (mpmc_size(queue) == 0 && !mpmc_is_closed(queue))
+        {
+            wait_word(&queue->items, items);
+        }
+        atomic_fetch_sub(&queue->items_waiting, 1);
+    }
+}
+
+// Closes the queue and wakes every blocked caller. Items already in the queue
+// can still be removed. Returns 0 if this call closed the queue or -1 with
+// errno set to EPIPE if it was already closed, so exactly one of several
+// concurrent closers succeeds.
+int mpmc_close(mpmc_t* queue)
+{
+    int open = 0;
+    if (!atomic_compare_exchange_strong(&queue->closed, &open, 1))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    atomic_fetch_add(&queue->items, 1);
+    atomic_fetch_add(&queue->space, 1);
+    wake_word(&queue->items, INT_MAX);
+    wake_word(&queue->space, INT_MAX);
+    return 0;
+}
+
+// Returns 0 if the queue is open and 1 if it is closed.
+int mpmc_is_closed(mpmc_t* queue)
+{
+    return atomic_load(&queue->closed);
+}
+
+// Returns the approximate number of items in the queue. Slots claimed by an
+// add that has not written its item yet are counted, and the value may be
+// stale by the time it is used.
+int mpmc_size(mpmc_t* queue)
+{
+    size_t dequeue = atomic_load(&queue->dequeue_pos);
+    size_t enqueue = atomic_load(&queue->enqueue_pos);
+    return enqueue > dequeue ? (int) (enqueue - dequeue) : 0;
+}
@@ -0,0 +1,80 @@
+#ifndef mpmc_h
+#define mpmc_h
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define MPMC_CACHE_LINE 64
+
+typedef struct mpmc_cell_t
+{
+    atomic_size_t seq;
+    void*         data;
+} mpmc_cell_t;
+
+// Defines a bounded lock-free multi-producer/multi-consumer FIFO queue. Every
+// slot carries a sequence number telling producers and consumers whose turn
+// it is, so an uncontended add or remove is a single compare-and-swap.
+// Blocking adds and removes only sleep, on a futex, when the queue is full or
+// empty.
+typedef struct mpmc_t
+{
+    // Producer side
+    _Alignas(MPMC_CACHE_LINE) atomic_size_t enqueue_pos;
+
+    // Consumer side
+    _Alignas(MPMC_CACHE_LINE) atomic_size_t dequeue_pos;
+
+    // Wait words, bumped on every add (items) and remove (space)
+    _Alignas(MPMC_CACHE_LINE) atomic_uint items;
+    atomic_int       items_waiting;
+    _Alignas(MPMC_CACHE_LINE) atomic_uint space;
+    atomic_int       space_waiting;
+
+    // Shared properties
+    _Alignas(MPMC_CACHE_LINE) size_t capacity;
+    size_t           mask;
+    atomic_int       closed;
+    mpmc_cell_t*     cells;
+} mpmc_t;
+
+// Allocates and returns a new queue. The capacity is rounded up to a power of
+// two. Sets errno and returns NULL if initialization failed.
+mpmc_t* mpmc_init(size_t capacity);
+
+// Releases the queue resources.
+void mpmc_dispose(mpmc_t* queue);
+
+// Enqueues an item without blocking. Returns 0 if the add succeeded or -1 if
+// the queue is full or closed. If -1 is returned, errno will be set.
+int mpmc_try_add(mpmc_t* queue, void* value);
+
+// Dequeues an item without blocking. Returns 0 if an item was removed or -1
+// if the queue is empty.
+int mpmc_try_remove(mpmc_t* queue, void** value);
+
+// Enqueues an item, blocking while the queue is full. Returns 0 if the add
+// succeeded or -1 if the queue is closed. If -1 is returned, errno will be
+// set.
+int mpmc_add(mpmc_t* queue, void* value);
+
+// Dequeues an item, blocking while the queue is empty. Returns 0 if an item
+// was removed or -1 once the queue is closed and empty. If -1 is returned,
+// errno will be set.
+int mpmc_remove(mpmc_t* queue, void** value);
+
+// Closes the queue and wakes every blocked caller. Items already in the queue
+// can still be removed. Returns 0 if this call closed the queue or -1 with
+// errno set to EPIPE if it was already closed, so exactly one of several
+// concurrent closers succeeds.
+int mpmc_close(mpmc_t* queue);
+
+// Returns 0 if the queue is open and 1 if it is closed.
+int mpmc_is_closed(mpmc_t* queue);
+
+// Returns the approximate number of items in the queue. Slots claimed by an
+// add that has not written its item yet are counted, and the value may be
+// stale by the time it is used.
+int mpmc_size(mpmc_t* queue);
+
+#endif
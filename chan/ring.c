@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+// Allocates and returns a new ring holding up to capacity elements of
+// elem_size bytes. The capacity is rounded up to a power of two. Sets errno
+// and returns NULL if initialization failed.
+ring_t* ring_init(size_t capacity, size_t elem_size)
+{
+    if (capacity == 0 || elem_size == 0 || capacity > ((size_t) -1 >> 1) / elem_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t rounded = 1;
+    while (rounded < capacity)
+    {
+        rounded <<= 1;
+    }
+
+    ring_t* ring = NULL;
+    if (posix_memalign((void**) &ring, RING_CACHE_LINE, sizeof(ring_t)) != 0)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ring->data = (char*) malloc(rounded * elem_size);
+    if (!ring->data)
+    {
+        free(ring);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&ring->mu, NULL) != 0)
+    {
+        free(ring->data);
+        free(ring);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&ring->cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&ring->mu);
+        free(ring->data);
+        free(ring);
+        return NULL;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->high_water, 0);
+    atomic_init(&ring->waiting, 0);
+    atomic_init(&ring->closed, 0);
+    ring->capacity = rounded;
+    ring->mask = rounded - 1;
+    ring->elem_size = elem_size;
+    return ring;
+}
+
+// Releases the ring resources.
+void ring_dispose(ring_t* ring)
+{
+    pthread_mutex_destroy(&ring->mu);
+    pthread_cond_destroy(&ring->cond);
+    free(ring->data);
+    free(ring);
+}
+
+// Copies the element into the ring. Returns 0 if the push succeeded or -1 if
+// the ring is full or closed. If -1 is returned, errno will be set.
+int ring_push(ring_t* ring, const void* elem)
+{
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == ring->capacity)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    memcpy(ring->data + (tail & ring->mask) * ring->elem_size, elem, ring->elem_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    size_t depth = tail + 1 - head;
+    if (depth > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+    {
+        atomic_store_explicit(&ring->high_water, depth, memory_order_relaxed);
+    }
+
+    // Pairs with the fence in ring_pop: either the consumer sees the new
+    // tail, or we see that it is waiting and wake it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->waiting, memory_order_relaxed))
+    {
+        pthread_mutex_lock(&ring->mu);
+        pthread_cond_signal(&ring->cond);
+        pthread_mutex_unlock(&ring->mu);
+    }
+    return 0;
+}
+
+// Copies the oldest element out of the ring. Returns 0 if an element was
+// popped or -1 if the ring is empty.
+int ring_try_pop(ring_t* ring, void* elem)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail)
+    {
+        return -1;
+    }
+
+    memcpy(elem, ring->data + (head & ring->mask) * ring->elem_size, ring->elem_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
+
+// Copies the oldest element out of the ring, sleeping until one is pushed.
+// Returns 0 if an element was popped or -1 once the ring is closed and empty.
+// If -1 is returned, errno will be set.
+int ring_pop(ring_t* ring, void* elem)
+{
+    while (ring_try_pop(ring, elem) != 0)
+    {
+        pthread_mutex_lock(&ring->mu);
+        atomic_store_explicit(&ring->waiting, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (ring_depth(ring) == 0 && !atomic_load(&ring->closed))
+        {
+            pthread_cond_wait(&ring->cond, &ring->mu);
+        }
+        atomic_store_explicit(&ring->waiting, 0, memory_order_relaxed);
+        pthread_mutex_unlock(&ring->mu);
+
+        if (ring_depth(ring) == 0 && atomic_load(&ring->closed))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Closes the ring. Pending elements can still be popped, after which pops
+// return an error. Wakes a sleeping consumer.
+void ring_close(ring_t* ring)
+{
+    pthread_mutex_lock(&ring->mu);
+    atomic_store(&ring->closed, 1);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mu);
+}
+
+// Returns the number of elements currently in the ring.
+size_t ring_depth(ring_t* ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return tail - head;
+}
+
+// Returns the largest number of elements the ring has held at once.
+size_t ring_high_water(ring_t* ring)
+{
+    return atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+}
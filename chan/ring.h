@@ -0,0 +1,65 @@
+#ifndef ring_h
+#define ring_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define RING_CACHE_LINE 64
+
+// Defines a lock-free single-producer/single-consumer ring of fixed-size
+// elements. Exactly one thread may push and exactly one thread may pop. Pushes
+// never block. A consumer that finds the ring empty can sleep until the
+// producer pushes, the mutex is only taken when the consumer is asleep.
+typedef struct ring_t
+{
+    // Consumer side
+    _Alignas(RING_CACHE_LINE) atomic_size_t head;
+
+    // Producer side
+    _Alignas(RING_CACHE_LINE) atomic_size_t tail;
+    atomic_size_t    high_water;
+
+    // Shared properties
+    _Alignas(RING_CACHE_LINE) size_t capacity;
+    size_t           mask;
+    size_t           elem_size;
+    char*            data;
+    atomic_int       waiting;
+    atomic_int       closed;
+    pthread_mutex_t  mu;
+    pthread_cond_t   cond;
+} ring_t;
+
+// Allocates and returns a new ring holding up to capacity elements of
+// elem_size bytes. The capacity is rounded up to a power of two. Sets errno
+// and returns NULL if initialization failed.
+ring_t* ring_init(size_t capacity, size_t elem_size);
+
+// Releases the ring resources.
+void ring_dispose(ring_t* ring);
+
+// Copies the element into the ring. Returns 0 if the push succeeded or -1 if
+// the ring is full or closed. If -1 is returned, errno will be set.
+int ring_push(ring_t* ring, const void* elem);
+
+// Copies the oldest element out of the ring. Returns 0 if an element was
+// popped or -1 if the ring is empty.
+int ring_try_pop(ring_t* ring, void* elem);
+
+// Copies the oldest element out of the ring, sleeping until one is pushed.
+// Returns 0 if an element was popped or -1 once the ring is closed and empty.
+// If -1 is returned, errno will be set.
+int ring_pop(ring_t* ring, void* elem);
+
+// Closes the ring. Pending elements can still be popped, after which pops
+// return an error. Wakes a sleeping consumer.
+void ring_close(ring_t* ring);
+
+// Returns the number of elements currently in the ring.
+size_t ring_depth(ring_t* ring);
+
+// Returns the largest number of elements the ring has held at once.
+size_t ring_high_water(ring_t* ring);
+
+#endif
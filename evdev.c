@@ -0,0 +1,136 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#include "evdev.h"
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define NLONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static bool test_bit(const unsigned long *bits, int bit) {
+    return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+// A keyboard reports letter keys; mice and power buttons do not. Our own
+// virtual keyboard is skipped so we never read back what we inject.
+static bool is_keyboard(int fd) {
+    unsigned long keys[NLONGS(KEY_CNT)] = { 0 };
+    char name[256] = "";
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+    if (strcmp(name, UINPUT_NAME) == 0) {
+        return false;
+    }
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0) {
+        return false;
+    }
+    return test_bit(keys, KEY_A) && test_bit(keys, KEY_Z) && test_bit(keys, KEY_ENTER);
+}
+
+static int open_and_grab(const char *path, bool keyboards_only) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        if (!keyboards_only) fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (keyboards_only && !is_keyboard(fd)) {
+        close(fd);
+        return -1;
+    }
+    // event times on the same clock as the rest of the latency stamps
+    int clock = CLOCK_MONOTONIC;
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+    if (ioctl(fd, EVIOCGRAB, 1) < 0) {
+        fprintf(stderr, "Could not grab %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fprintf(stderr, "Grabbed %s\n", path);
+    return fd;
+}
+
+int evdev_open_keyboards(const char **paths, int npaths, int *fds, int max) {
+    int n = 0;
+    if (npaths > 0) {
+        for (int i = 0; i < npaths && n < max; i++) {
+            int fd = open_and_grab(paths[i], false);
+            if (fd >= 0) fds[n++] = fd;
+        }
+        return n;
+    }
+
+    DIR *dir = opendir("/dev/input");
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open /dev/input: %s\n", strerror(errno));
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && n < max) {
+        if (strncmp(entry->d_name, "event", 5) != 0) {
+            continue;
+        }
+        char path[300];
+        snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+        int fd = open_and_grab(path, true);
+        if (fd >= 0) fds[n++] = fd;
+    }
+    closedir(dir);
+    return n;
+}
+
+void evdev_close_keyboards(int *fds, int n) {
+    for (int i = 0; i < n; i++) {
+        ioctl(fds[i], EVIOCGRAB, 0);
+        close(fds[i]);
+    }
+}
+
+int uinput_open(void) {
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_EVBIT, EV_REL);
+    ioctl(fd, UI_SET_EVBIT, EV_SYN);
+    // every code an X keycode can name, plus the buttons and the wheel
+    for (int code = 1; code < 256 - 8; code++) {
+        ioctl(fd, UI_SET_KEYBIT, code);
+    }
+    ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+    ioctl(fd, UI_SET_KEYBIT, BTN_MIDDLE);
+    ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+    ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = 0x1;
+    setup.id.product = 0x1;
+    strncpy(setup.name, UINPUT_NAME, UINPUT_MAX_NAME_SIZE - 1);
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+void uinput_close(int fd) {
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+}
+
+void input_event_set(struct input_event *ev, int type, int code, int value) {
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
@@ -0,0 +1,28 @@
+#ifndef evdev_h
+#define evdev_h
+
+#include <stdbool.h>
+#include <linux/input.h>
+
+#define EVDEV_MAX_DEVICES 16
+#define UINPUT_NAME "xremap virtual keyboard"
+
+// Opens and grabs the given event devices, or every keyboard under
+// /dev/input when npaths is 0. Stores up to max descriptors in fds and
+// returns how many were opened.
+int evdev_open_keyboards(const char **paths, int npaths, int *fds, int max);
+
+// Releases the grab and closes every descriptor.
+void evdev_close_keyboards(int *fds, int n);
+
+// Creates the virtual keyboard remapped events are written to. Returns the
+// uinput descriptor, or -1 with errno set.
+int uinput_open(void);
+
+// Destroys the virtual keyboard.
+void uinput_close(int fd);
+
+// Fills ev with an input event of the given type, code and value.
+void input_event_set(struct input_event *ev, int type, int code, int value);
+
+#endif
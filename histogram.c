@@ -0,0 +1,80 @@
+#include "histogram.h"
+
+static int bucket_of(uint64_t value)
+{
+    if (value < HIST_SUB)
+    {
+        return (int) value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    int shift = exp - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((value >> shift) & (HIST_SUB - 1));
+}
+
+// Largest value that falls into bucket.
+static uint64_t bucket_upper(int bucket)
+{
+    if (bucket < HIST_SUB)
+    {
+        return bucket;
+    }
+    int shift = bucket / HIST_SUB - 1;
+    uint64_t lower = (uint64_t) (HIST_SUB + bucket % HIST_SUB) << shift;
+    return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+void hist_init(histogram_t* hist)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        atomic_init(&hist->counts[i], 0);
+    }
+    atomic_init(&hist->total, 0);
+    atomic_init(&hist->max, 0);
+}
+
+void hist_record(histogram_t* hist, uint64_t value)
+{
+    atomic_fetch_add_explicit(&hist->counts[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+    if (value > atomic_load_explicit(&hist->max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+    }
+}
+
+uint64_t hist_count(histogram_t* hist)
+{
+    return atomic_load_explicit(&hist->total, memory_order_relaxed);
+}
+
+uint64_t hist_max(histogram_t* hist)
+{
+    return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+uint64_t hist_percentile(histogram_t* hist, double p)
+{
+    uint64_t total = hist_count(hist);
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (p * total + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            uint64_t upper = bucket_upper(i);
+            uint64_t max = hist_max(hist);
+            return upper < max ? upper : max;
+        }
+    }
+    return hist_max(hist);
+}
@@ -0,0 +1,38 @@
+#ifndef histogram_h
+#define histogram_h
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Log-bucketed histogram in the style of HdrHistogram: every power of two is
+// split into HIST_SUB linear buckets, so any value is counted with at most
+// 1/HIST_SUB relative error. Recording is a couple of relaxed atomic adds,
+// any thread may read while one thread records.
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct histogram_t
+{
+    atomic_ulong counts[HIST_BUCKETS];
+    atomic_ulong total;
+    atomic_ulong max;
+} histogram_t;
+
+// Clears every bucket.
+void hist_init(histogram_t* hist);
+
+// Counts one value. Only one thread may record into a histogram.
+void hist_record(histogram_t* hist, uint64_t value);
+
+// Returns the number of recorded values.
+uint64_t hist_count(histogram_t* hist);
+
+// Returns the largest recorded value.
+uint64_t hist_max(histogram_t* hist);
+
+// Returns an upper bound of the value below which a fraction p (0 to 1) of
+// the recorded values fall, 0 when the histogram is empty.
+uint64_t hist_percentile(histogram_t* hist, double p);
+
+#endif
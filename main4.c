@@ -4,59 +4,297 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <libgen.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <signal.h>
+#include <syslog.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <ctype.h>
 #include <errno.h>
+#include <poll.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xproto.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
 #include <X11/extensions/record.h>
 #include <X11/extensions/XTest.h>
+#include <X11/extensions/XInput2.h>
 #include <X11/XKBlib.h>
 #include <X11/Xmu/WinUtil.h>
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
 
 #include "khash.h"
-
+#include "kvec.h"
+#include "kstring.h"
+#include "mapping.h"
+#include "ring.h"
+#include "evdev.h"
+#include "histogram.h"
+#include "wintree.h"
+
+KHASH_MAP_INIT_INT64(WindowSlot, int)
+
+#define CLASS_CACHE_SIZE 64
+// ancestors looked at for a WM_CLASS, deeper windows are cut off
+#define WINDOW_MAX_DEPTH 32
+
+// Resolved top-level WM_CLASS for a window, kept in a doubly linked LRU list
+// threaded through the entries array by index.
+typedef struct {
+    Window window;
+    char *class;
+    int prev;
+    int next;
+} ClassCacheEntry;
+
+// Shared by the injector, which resolves the focused window, and the window
+// worker, which resolves windows to grab; lock guards all of it.
 typedef struct {
-    bool shift;
-    bool control;
-    bool alt;
-    bool super;
-    KeyCode key;
-    int button;
-} Hotkey;
+    pthread_mutex_t lock;
+    ClassCacheEntry entries[CLASS_CACHE_SIZE];
+    khash_t(WindowSlot) *index;
+    int head;
+    int tail;
+    int free;
+    unsigned long hits;
+    unsigned long misses;
+} ClassCache;
+
+// Key grabs we hold on one window, as (keycode << 8 | modifiers) sorted
+// ascending, so two sets diff in a single merge pass.
+typedef struct {
+    unsigned short *keys;
+    int n;
+} GrabSet;
 
-Hotkey* new_hotkey() {
-    Hotkey* h = malloc(sizeof(Hotkey));
-    h->shift = false;
-    h->control = false;
-    h->alt = false;
-    h->super = false;
-    h->key = 0;
-    h->button = 0;
-    return h;
-}
+KHASH_MAP_INIT_INT64(GrabSets, GrabSet)
+KHASH_SET_INIT_INT64(WindowSet)
 
-KHASH_MAP_INIT_STR(Mappings, Hotkey*)
+typedef kvec_t(Window) WindowVec;
 
-KHASH_MAP_INIT_INT(Config, khash_t(Mappings)*)
+// Every grab issued on ctrl_conn, per window. scratch holds the wanted set
+// while a window is being synced. Only touched with ctrl_conn locked.
+typedef struct {
+    khash_t(GrabSets) *windows;
+    unsigned short *scratch;
+    int scratch_cap;
+    unsigned long grabs;
+    unsigned long ungrabs;
+} GrabRegistry;
+
+// Modifier roles of keycodes, rebuilt from the XKB modifier map whenever the
+// keyboard mapping changes. role holds the modifier bits a held key sets, 0
+// for ordinary keys and for locks. mod_keycode holds the keycode faked to
+// hold each modifier bit, 0 if there is none.
+typedef struct {
+    unsigned char role[256];
+    KeyCode mod_keycode[8];
+} Keymap;
+
+typedef struct {
+    unsigned long batches;
+    unsigned long events;
+    long total_ns;
+    long max_ns;
+} InjectStats;
+
+// An injected event we have not seen come back yet is forgotten after this
+// long, so an echo the server never sends cannot swallow a real keystroke.
+#define ECHO_TIMEOUT_NS 1000000000UL
+
+// Our own XTest key and button events as they come back through the record
+// context or as XInput2 raw events. Neither tells them from real input, the
+// XTEST devices are shared by every XTest client. The injector counts each
+// event before sending it and intercept() drops as many copies, indexed by
+// type - KeyPress and keycode or button. stamp is when a slot was last
+// counted, in CLOCK_MONOTONIC ns.
+typedef struct {
+    atomic_uint pending[ButtonRelease - KeyPress + 1][256];
+    atomic_ulong stamp[ButtonRelease - KeyPress + 1][256];
+} EchoFilter;
+
+// Compact copy of a recorded event, passed from the record thread to the
+// injector thread. detail holds the keycode, button or focus mode. device is
+// the XInput2 source device or evdev device index + 1, 0 when the event came
+// through XRecord. atom is the changed property of a PropertyNotify, parent
+// the new parent of a CreateNotify or ReparentNotify. stamp is when we first
+// saw it, in CLOCK_MONOTONIC ns.
+typedef struct {
+    unsigned char type;
+    unsigned char detail;
+    unsigned short device;
+    Window window;
+    union {
+        Atom atom;
+        Window parent;
+    };
+    uint64_t stamp;
+} RecordedEvent;
+
+// Messages to the window worker that are not X events: the published table
+// changed, so the grabs have to follow it.
+#define TableChangedEvent LASTEvent
+
+// Stages of a keystroke timed into App.latency. classify and queue are
+// measured for every event, the rest only on the paths that run them. total
+// runs from the first sight of a key to the flush of its remap.
+typedef enum {
+    STAGE_CLASSIFY,
+    STAGE_QUEUE,
+    STAGE_LOOKUP,
+    STAGE_CLASS,
+    STAGE_INJECT,
+    STAGE_TOTAL,
+    STAGE_COUNT,
+} Stage;
+
+static const char *STAGE_NAMES[STAGE_COUNT] = { "classify", "queue", "lookup", "class", "inject", "total" };
+
+// Where key and button events come from. XRecord sees every event sent to
+// every client; XInput2 raw events are delivered once, to us, and carry the
+// source device. evdev grabs the keyboards below X and writes the result to
+// a uinput keyboard, so X never sees a key we remap. Window structure events
+// always come through a second XRecord context of their own.
+typedef enum {
+    BACKEND_RECORD,
+    BACKEND_XI2,
+    BACKEND_EVDEV,
+} Backend;
+
+#define EVENT_RING_SIZE 1024
+#define WINDOW_RING_SIZE 4096
+
+// counters per event type, core events and the XKB event base both fit
+#define EVENT_TYPE_COUNT 128
+#define KEY_RANGE_MAX 4
+
+static const char *EVENT_NAMES[LASTEvent] = {
+    NULL, NULL, "KeyPress", "KeyRelease", "ButtonPress", "ButtonRelease", "MotionNotify",
+    "EnterNotify", "LeaveNotify", "FocusIn", "FocusOut", "KeymapNotify", "Expose",
+    "GraphicsExpose", "NoExpose", "VisibilityNotify", "CreateNotify", "DestroyNotify",
+    "UnmapNotify", "MapNotify", "MapRequest", "ReparentNotify", "ConfigureNotify",
+    "ConfigureRequest", "GravityNotify", "ResizeRequest", "CirculateNotify",
+    "CirculateRequest", "PropertyNotify", "SelectionClear", "SelectionRequest",
+    "SelectionNotify", "ColormapNotify", "ClientMessage", "MappingNotify", "GenericEvent",
+};
 
 typedef struct {
 	Display *data_conn;
 	Display *ctrl_conn;
 	XRecordContext record_ctx;
+	// whether the key context records keys and buttons, -1 before the first
+	// table
+	int record_input;
+	// the last property change intercept() passed on; every client
+	// listening on the root gets, and XRecord reports, its own copy
+	Window last_property_window;
+	Atom last_property_atom;
+	Time last_property_time;
+	// events each record context received, by type
+	atomic_ulong key_event_counts[EVENT_TYPE_COUNT];
+	atomic_ulong window_event_counts[EVENT_TYPE_COUNT];
 	pthread_t sigwait_thread;
+	pthread_t injector_thread;
+	ring_t *events;
+	// window structure events are recorded on window_data_conn by the window
+	// reader and handled by the window worker, which asks the server about
+	// windows on window_conn. Key grabs are still issued on ctrl_conn, they
+	// are plain requests and hold its lock only briefly.
+	Display *window_data_conn;
+	Display *window_conn;
+	XRecordContext window_ctx;
+	pthread_t window_reader_thread;
+	pthread_t window_thread;
+	ring_t *window_events;
+	// the injector, the window reader and the reload thread all post to
+	// window_events
+	pthread_mutex_t window_push_lock;
+	// the last event the window reader posted and, for a property change,
+	// its server time; the server records one copy per client it delivers
+	// an event to
+	RecordedEvent last_window_event;
+	Time last_window_time;
+	// set once the window context records, so the mirror can be loaded
+	// without missing a change
+	pthread_mutex_t window_start_lock;
+	pthread_cond_t window_started;
+	bool window_recording;
 	sigset_t sigset;
 	int debug;
-	khash_t(Config) *config;
+	const char *config_path;
+	Backend backend;
+	int xi_opcode;
+	EchoFilter echoes;
+	// our own injected events dropped before they reached the injector
+	atomic_ulong own_events;
+	Window wake_window;
+	const char *evdev_paths[EVDEV_MAX_DEVICES];
+	int nevdev_paths;
+	int evdev_fds[EVDEV_MAX_DEVICES];
+	int nevdev;
+	int uinput_fd;
+	unsigned char key_down[256];
+	unsigned char key_consumed[256];
+	// modifier keycodes held down, so a remap releases and restores the keys
+	// actually pressed rather than the first keycode of each modifier
+	unsigned char mod_down[256];
+	bool latch_mods;
+	InjectStats inject_stats;
+	histogram_t latency[STAGE_COUNT];
+	uint64_t event_stamp;
+	// the published config; swapped whole by the reload thread
+	_Atomic(ConfigTable *) table;
+	// the injector's snapshot of table, refreshed between events
+	Dispatch *dispatch;
+	unsigned long table_generation;
+	// epoch reclamation: reader_epoch is the epoch the injector entered its
+	// current event in, 0 while it is between events
+	atomic_ulong epoch;
+	atomic_ulong reader_epoch;
+	// the window worker's snapshot and epoch, same rules
+	Dispatch *window_dispatch;
+	unsigned long window_generation;
+	atomic_ulong window_epoch;
+	pthread_t reload_thread;
+	int reload_stop;
+	MappingBackend mapping_backend;
+	uint64_t lookup_start;
+	Keymap keymap;
+	bool keymap_dirty;
+	int xkb_event_base;
+	ClassCache *class_cache;
+	WindowTree *tree;
+	GrabRegistry *grabs;
+	// grab windows when they first take focus instead of at creation;
+	// focused holds the windows already synced
+	bool lazy_grabs;
+	khash_t(WindowSet) *focused;
+	Window root;
+	Atom net_active_window;
+	Atom net_client_list;
+	// the last _NET_CLIENT_LIST seen, sorted
+	WindowVec clients;
+	Window focus_window;
+	// focus_window as the window worker may read it, and in lazy mode a
+	// focused window the injector could not post without waiting
+	atomic_ulong shared_focus;
+	atomic_ulong focus_rescan;
+	char *focus_class;
+	int focus_class_id;
 	Hotkey *current;
-	volatile int handling;
 } App;
 
 static App *app = NULL;
@@ -65,72 +303,89 @@ void *sig_handler (void *user_data);
 
 void intercept(XPointer user_data, XRecordInterceptData *data);
 void grab_all_keys(App *app);
+void grab_keys_for_class(App *app, Window w, const char *class);
+void switch_table(App *app, ConfigTable *table);
+void switch_window_table(App *app, ConfigTable *table);
+void push_window_event(App *app, const RecordedEvent *ev);
+bool try_push_window_event(App *app, const RecordedEvent *ev);
+void dump_event_counts(App *app);
 
 void print_usage (const char *program_name);
 
-unsigned char SHIFT_MASK = 0b00001000;
-unsigned char CONTROL_MASK = 0b00000100;
-unsigned char ALT_MASK = 0b00000010;
-unsigned char SUPER_MASK = 0b00000001;
-unsigned char BUTTON1_MASK = 0b10000000;
-unsigned char BUTTON2_MASK = 0b01000000;
-unsigned char BUTTON3_MASK = 0b00100000;
-
-Hotkey * short_to_hotkey(unsigned short in) {
-    Hotkey *out = new_hotkey();
-    out->shift = ((SHIFT_MASK << 8) & in) > 0;
-    out->control = ((CONTROL_MASK << 8) & in) > 0;
-    out->alt = ((ALT_MASK << 8) & in) > 0;
-    out->super = ((SUPER_MASK << 8) & in) > 0;
-    out->button = ((BUTTON1_MASK << 8) & in) > 0 ? Button1 : 0;
-    out->button = ((BUTTON2_MASK << 8) & in) > 0 ? Button2 : 0;
-    out->button = ((BUTTON3_MASK << 8) & in) > 0 ? Button3 : 0;
-    out->key = (char)(in& 0xFF);
-    return out;
-}
-
-unsigned short hotkey_to_short(Hotkey h) {
-    unsigned short out = 0;
-    if (h.shift) out |= (SHIFT_MASK << 8);
-    if (h.control) out |= (CONTROL_MASK << 8);
-    if (h.alt) out |= (ALT_MASK << 8);
-    if (h.super) out |= (SUPER_MASK << 8);
-    if (h.button == Button1) out |= (BUTTON1_MASK << 8);
-    if (h.button == Button2) out |= (BUTTON2_MASK << 8);
-    if (h.button == Button3) out |= (BUTTON3_MASK << 8);
-    out |= h.key;
-    return out;
-}
-
-void hotkey_to_grab_key(Hotkey h, int *keycode, unsigned int *modifiers) {
-    *keycode = h.key;
-    *modifiers = 0;
-
-    if (h.shift) *modifiers |= ShiftMask;
-    if (h.control) *modifiers |= ControlMask;
-    if (h.alt) *modifiers |= Mod1Mask;
-    if (h.super) *modifiers |= Mod4Mask;
-}
-
-void dump_hotkey(Hotkey h) {
-    fprintf(stderr, "Hotkey: %d|%d|%d|%d - %d / %d\n", h.shift, h.control, h.alt, h.super, h.key, h.button);
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Preferred keysyms for the keycode faked to hold each modifier bit, indexed
+// by ShiftMapIndex..Mod5MapIndex. Lock and Mod2 (NumLock) toggle instead of
+// being held, so lock keys are never faked.
+static const KeySym MODIFIER_KEYSYMS[8] = {
+    XK_Shift_L, NoSymbol, XK_Control_L, XK_Alt_L,
+    NoSymbol, XK_Hyper_L, XK_Super_L, XK_ISO_Level3_Shift
+};
+
+static bool is_lock_keysym(KeySym ks) {
+    return ks == XK_Caps_Lock || ks == XK_Shift_Lock || ks == XK_Num_Lock || ks == XK_Scroll_Lock;
+}
+
+// Builds the keycode role and modifier keycode tables from the server's XKB
+// modifier map. Only called at startup and after a mapping change.
+void build_keymap(Display *d, Keymap *keymap) {
+    memset(keymap, 0, sizeof(Keymap));
+    XkbDescPtr xkb = XkbGetMap(d, XkbModifierMapMask | XkbKeySymsMask, XkbUseCoreKbd);
+    if (xkb == NULL) {
+        fprintf(stderr, "Could not get keyboard map\n");
+        return;
+    }
+    for (int kc = xkb->min_key_code; kc <= xkb->max_key_code; kc++) {
+        unsigned char mods = xkb->map->modmap[kc];
+        if (mods == 0) {
+            continue;
+        }
+        KeySym ks = XkbKeyNumSyms(xkb, kc) > 0 ? XkbKeySymEntry(xkb, kc, 0, 0) : NoSymbol;
+        if (is_lock_keysym(ks)) {
+            continue;
+        }
+        keymap->role[kc] = mods;
+        for (int bit = 0; bit < 8; bit++) {
+            if ((mods & (1 << bit)) && (keymap->mod_keycode[bit] == 0 || ks == MODIFIER_KEYSYMS[bit])) {
+                keymap->mod_keycode[bit] = kc;
+            }
+        }
+    }
+    XkbFreeKeyboard(xkb, 0, True);
 }
 
 int handle_token(Display *d, char *token, Hotkey *h) {
     if (strcmp(token, "shift") == 0) {
-        h->shift = true;
+        h->mods |= ShiftMask;
+    } else if (strcmp(token, "lock") == 0 || strcmp(token, "mod2") == 0) {
+        // build_keymap gives the lock keys no modifier role, so these bits
+        // are never part of the tracked state and could never match
+        fprintf(stderr, "Lock modifiers are ignored, remove %s from the hotkey\n", token);
+        return 1;
     } else if (strcmp(token, "control") == 0 || strcmp(token, "ctrl") == 0) {
-        h->control = true;
+        h->mods |= ControlMask;
     } else if (strcmp(token, "alt") == 0 || strcmp(token, "mod1") == 0) {
-        h->alt = true;
+        h->mods |= Mod1Mask;
+    } else if (strcmp(token, "hyper") == 0 || strcmp(token, "mod3") == 0) {
+        h->mods |= Mod3Mask;
     } else if (strcmp(token, "super") == 0 || strcmp(token, "mod4") == 0) {
-        h->super = true;
+        h->mods |= Mod4Mask;
+    } else if (strcmp(token, "mod5") == 0) {
+        h->mods |= Mod5Mask;
     } else if (strcmp(token, "b1") == 0) {
         h->button = Button1;
     } else if (strcmp(token, "b2") == 0) {
-        h->super = Button2;
+        h->button = Button2;
     } else if (strcmp(token, "b3") == 0) {
-        h->super = Button3;
+        h->button = Button3;
+    } else if (strcmp(token, "b4") == 0) {
+        h->button = Button4;
+    } else if (strcmp(token, "b5") == 0) {
+        h->button = Button5;
     } else {
         KeySym ks = NoSymbol;
         if ((ks = XStringToKeysym(token)) == NoSymbol) {
@@ -149,45 +404,47 @@ int handle_token(Display *d, char *token, Hotkey *h) {
     return 0;
 }
 
-Hotkey* parse_string(Display *d, const char* input) {
-    unsigned char mods = 0;
-    unsigned char keycode = 0; 
-    unsigned short out = 0;
-    Hotkey *h = new_hotkey();
-    char* inputCopy = strdup(input);
-    char* token = strtok(inputCopy, "-");
-    while (token != NULL) {
+// Parses a hotkey like "control-shift-a" in place: every '-' is overwritten
+// with a NUL so the tokens can be handed to handle_token without copies.
+int parse_hotkey(Display *d, char *input, Hotkey *h) {
+    ks_tokaux_t aux;
+    memset(&aux, 0, sizeof(aux));
+    *h = (Hotkey){ 0, 0, 0 };
+    for (char *token = kstrtok(input, "-", &aux); token != NULL; token = kstrtok(NULL, NULL, &aux)) {
+        *(char *)aux.p = '\0';
         if (handle_token(d, token, h) > 0) {
             fprintf(stderr, "Could not parse string %s", token);
-            free(h);
-            return NULL;
+            return 1;
         }
-        token = strtok(NULL, "-");
     }
-    free(inputCopy);
-    return h;
+    return 0;
 }
 
-void add_key(Display *d, khash_t(Config) *config, const char * from, const char *class, const char *to) {
-    Hotkey *hfrom = parse_string(d, from);
-    if (hfrom == NULL) {
+// Adds the mapping of from to to for windows of class, which must be
+// interned in arena. from and to are parsed in place.
+void add_key(Display *d, khash_t(Config) *config, Arena *arena, char *from, const char *class, char *to) {
+    fprintf(stderr, "Adding config key %s - %s for app %s\n", from, to, class);
+    Hotkey hfrom;
+    if (parse_hotkey(d, from, &hfrom) != 0) {
         fprintf(stderr, "Could not parse from hotkey: %s\n", from);
         return;
     }
-    Hotkey *hto = parse_string(d, to);
-    if (hto == NULL) {
+    // the dispatch table has one column per key or button
+    if (hfrom.key > 0 && hfrom.button > 0) {
+        fprintf(stderr, "Hotkeys combining a key and a button are not supported: %s\n", from);
+        return;
+    }
+    Hotkey *hto = arena_alloc(arena, sizeof(Hotkey));
+    if (parse_hotkey(d, to, hto) != 0) {
         fprintf(stderr, "Could not parse to hotkey: %s\n", to);
-        free(hfrom);
         return;
     }
 
-    unsigned short from_short = hotkey_to_short(*hfrom);
-    free(hfrom);
-    fprintf(stderr, "Adding config key %s - %s for app %s\n", from, to, class);
-    khint_t k = kh_get(Config, config, from_short);
+    unsigned int from_key = hotkey_to_int(hfrom);
+    khint_t k = kh_get(Config, config, from_key);
     if (k == kh_end(config)) {
         int ret;
-        k = kh_put(Config, config, from_short, &ret);
+        k = kh_put(Config, config, from_key, &ret);
         if (!ret) {
             fprintf(stderr, "Could not insert hotkey %s\n", from);
             return;
@@ -195,7 +452,7 @@ void add_key(Display *d, khash_t(Config) *config, const char * from, const char
         kh_value(config, k) = kh_init(Mappings);
     }
     khash_t(Mappings)* mappings = kh_value(config, k);
-    
+
     khint_t k2 = kh_get(Mappings, mappings, class);
     if (k2 == kh_end(mappings)) {
         int ret;
@@ -204,59 +461,282 @@ void add_key(Display *d, khash_t(Config) *config, const char * from, const char
     }
 }
 
-void load_configuration_file(App* app) {
-    app->config = kh_init(Config);
+// Parses one "from class to" line, NUL-terminated and writable. Blank lines
+// and lines starting with '#' are skipped.
+void parse_config_line(Display *d, ConfigTable *table, char *line) {
+    char *fields[3];
+    int nfields = 0;
+    // split on whitespace by hand: class names are often UTF-8, and kstrtok
+    // indexes its separator table with signed chars
+    char *p = line;
+    while (nfields < 3) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        fields[nfields++] = p;
+        while (*p != '\0' && !isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+    }
+    if (nfields == 0 || fields[0][0] == '#') {
+        return;
+    }
+    if (nfields < 3) {
+        fprintf(stderr, "Ignoring incomplete config line starting with %s\n", fields[0]);
+        return;
+    }
+    const char *class = arena_intern(&table->arena, fields[1]);
+    add_key(d, table->config, &table->arena, fields[0], class, fields[2]);
+}
 
-    if (1) {
+void config_file_path(App *app, char *path, size_t len) {
+    if (app->config_path != NULL) {
+        snprintf(path, len, "%s", app->config_path);
+    } else {
         struct passwd *pw = getpwuid(getuid());
         const char *homedir = pw->pw_dir;
-        char path[1000];
-        sprintf(path, "%s/%s", homedir, ".config/xremap" );
-        FILE *fd = fopen(path, "r");
-        if (fd == NULL) {
-            fprintf(stderr, "Error opening configuration file %s\n", path);
-        }
-        char line[255];
-        while (fgets(line, sizeof(line), fd) != NULL) {
-            char* from = strdup(strtok(line, " "));
-            char* class = strdup(strtok(NULL, " "));
-            char* to = strdup(strtok(NULL, " "));
-            to[strcspn(to, "\n")] = 0;
-            add_key(app->ctrl_conn, app->config, from, class, to);
-            free(from);
-            free(to);
-        }
-        fclose(fd);
+        snprintf(path, len, "%s/%s", homedir, ".config/xremap");
     }
 }
 
-Window get_top_window(Display* d, Window start) {
-    Window w = start;
-    Window parent = start;
-    Window root = None;
-    Window *children;
-    unsigned int nchildren;
-    Status s;
+// Reads the config through a private writable mapping, so lines are split
+// and terminated in place. Only a last line without a newline is copied,
+// otherwise the only allocations are the hash tables and the arena.
+void load_configuration_file(Display *d, ConfigTable *table, const char *path) {
+    table->config = kh_init(Config);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error opening configuration file %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t len = st.st_size;
+    char *data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping configuration file %s: %s\n", path, strerror(errno));
+        return;
+    }
 
-    while (parent != root) {
-        w = parent;
-        s = XQueryTree(d, w, &root, &parent, &children, &nchildren);
-        if (s) {
-            XFree(children);
+    char *end = data + len;
+    for (char *line = data; line < end; ) {
+        char *eol = memchr(line, '\n', end - line);
+        if (eol != NULL) {
+            *eol = '\0';
+            parse_config_line(d, table, line);
+            line = eol + 1;
+        } else {
+            // the last line has no newline to overwrite, copy it out; the
+            // arena keeps its own copies of what it needs
+            size_t n = end - line;
+            char *last = malloc(n + 1);
+            memcpy(last, line, n);
+            last[n] = '\0';
+            parse_config_line(d, table, last);
+            free(last);
+            break;
         }
     }
-    return w;
+    munmap(data, len);
 }
 
+// Identifies what a compiled config depends on: the config file and the
+// keyboard mapping its keysyms were resolved against. Returns false when
+// the config cannot be stat'ed.
+bool dispatch_key(App *app, const char *path, DispatchKey *key) {
+    struct stat st;
+    memset(key, 0, sizeof(DispatchKey));
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    key->config_mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000UL + st.st_mtim.tv_nsec;
+    key->config_size = st.st_size;
+    key->config_ino = st.st_ino;
+
+    int min, max, per;
+    XDisplayKeycodes(app->ctrl_conn, &min, &max);
+    KeySym *syms = XGetKeyboardMapping(app->ctrl_conn, min, max - min + 1, &per);
+    uint64_t hash = FNV1A_INIT;
+    hash = fnv1a(hash, &min, sizeof(min));
+    hash = fnv1a(hash, &per, sizeof(per));
+    if (syms != NULL) {
+        hash = fnv1a(hash, syms, sizeof(KeySym) * (max - min + 1) * per);
+        XFree(syms);
+    }
+    hash = fnv1a(hash, &app->keymap, sizeof(Keymap));
+    key->keymap_fingerprint = hash;
+    return true;
+}
 
-Window *get_wm_window_list(Display *d, unsigned long *len) {
-    Atom prop = XInternAtom(d, "_NET_CLIENT_LIST", True);
+ConfigTable *new_config_table() {
+    static unsigned long generation = 0;
+    ConfigTable *table = malloc(sizeof(ConfigTable));
+    table->generation = ++generation;
+    table->config = NULL;
+    arena_init(&table->arena);
+    table->dispatch = NULL;
+    return table;
+}
+
+// Builds a table from the config, mapping the cache image next to it when
+// it was compiled from the same file and keyboard mapping. Otherwise parses
+// and compiles the config and refreshes the image. Returns NULL when the
+// config cannot be found.
+ConfigTable *load_config_table(App *app) {
+    char path[1000];
+    char cache[1024];
+    DispatchKey key;
+    config_file_path(app, path, sizeof(path));
+    snprintf(cache, sizeof(cache), "%s.cache", path);
+
+    XLockDisplay(app->ctrl_conn);
+    bool have_key = dispatch_key(app, path, &key);
+    XUnlockDisplay(app->ctrl_conn);
+    if (!have_key) {
+        fprintf(stderr, "Error opening configuration file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    ConfigTable *table = new_config_table();
+    if ((table->dispatch = load_dispatch_image(cache, &key)) != NULL) {
+        fprintf(stderr, "Loaded compiled config from %s\n", cache);
+        return table;
+    }
+    load_configuration_file(app->ctrl_conn, table, path);
+    table->dispatch = compile_dispatch(table->config);
+    if (save_dispatch_image(table->dispatch, cache, &key) != 0) {
+        fprintf(stderr, "Could not write config cache %s: %s\n", cache, strerror(errno));
+    }
+    return table;
+}
+
+// Starts an injector critical section: after this, the table the injector
+// uses cannot be freed until leave_table.
+void enter_table(App *app) {
+    atomic_store(&app->reader_epoch, atomic_load(&app->epoch));
+    ConfigTable *table = atomic_load(&app->table);
+    if (table->generation != app->table_generation) {
+        switch_table(app, table);
+    }
+}
+
+void leave_table(App *app) {
+    atomic_store(&app->reader_epoch, 0);
+}
+
+// The window worker's counterparts of enter_table and leave_table.
+void enter_window_table(App *app) {
+    atomic_store(&app->window_epoch, atomic_load(&app->epoch));
+    ConfigTable *table = atomic_load(&app->table);
+    if (table->generation != app->window_generation) {
+        switch_window_table(app, table);
+    }
+}
+
+void leave_window_table(App *app) {
+    atomic_store(&app->window_epoch, 0);
+}
+
+// 0: between events, the next one loads the new table. Otherwise the
+// reader is done with the old table once its current event started at or
+// after epoch.
+static bool reader_past(atomic_ulong *reader_epoch, unsigned long epoch) {
+    unsigned long reader = atomic_load(reader_epoch);
+    return reader == 0 || reader >= epoch;
+}
+
+// Publishes table and frees the previous one once the injector and the
+// window worker have moved past it. Runs on the reload thread; neither
+// reader ever waits.
+void publish_table(App *app, ConfigTable *table) {
+    ConfigTable *old = atomic_exchange(&app->table, table);
+    unsigned long epoch = atomic_fetch_add(&app->epoch, 1) + 1;
+    // the window worker only looks at the table when it has an event
+    RecordedEvent changed = { TableChangedEvent, 0, 0, None, { None }, now_ns() };
+    push_window_event(app, &changed);
+    while (!reader_past(&app->reader_epoch, epoch) || !reader_past(&app->window_epoch, epoch)) {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    free_config_table(old);
+}
+
+// Watches the config directory, so saves through rename are seen too, and
+// reloads after a burst of changes to the config file settles.
+void *config_watcher(void *user_data) {
+    App *app = (App*)user_data;
+    char path[1000];
+    config_file_path(app, path, sizeof(path));
+    char dir_buf[1000], base_buf[1000];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+    snprintf(base_buf, sizeof(base_buf), "%s", path);
+    const char *dir = dirname(dir_buf);
+    const char *base = basename(base_buf);
+
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        fprintf(stderr, "Could not watch %s, config reload disabled: %s\n", dir, strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    struct pollfd fds[2] = { { fd, POLLIN, 0 }, { app->reload_stop, POLLIN, 0 } };
+    bool pending = false;
+    for (;;) {
+        // a pending change is applied once the directory is quiet for 50ms
+        int ready = poll(fds, 2, pending ? 50 : -1);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        if (ready == 0 && pending) {
+            pending = false;
+            ConfigTable *table = load_config_table(app);
+            if (table != NULL) {
+                publish_table(app, table);
+                fprintf(stderr, "Reloaded %s\n", path);
+            }
+            continue;
+        }
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                if (ev->len > 0 && strcmp(ev->name, base) == 0) {
+                    pending = true;
+                }
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+Window *get_wm_window_list(Display *d, Atom prop, unsigned long *len) {
     Atom type;
     int format;
     unsigned long remain;
     unsigned char *list = 0;
 
-    fprintf(stderr, "Getting wm window list using _NET_CLIENT_LIST\n");
+    if (prop == None) {
+        return 0;
+    }
     if (XGetWindowProperty(d, DefaultRootWindow(d), prop, 0, (~0L), False, XA_WINDOW, &type, &format, len, &remain, &list) != Success) {
         fprintf(stderr, "Could not get list of windows from WM\n");
         return 0;
@@ -272,234 +752,953 @@ Window get_input_focus_window(Display* d) {
     return w;
 }
 
-Window get_active_window(Display *d) {
+Window get_active_window(Display *d, Atom netactivewindow) {
     Window root = XDefaultRootWindow(d);
-    Atom netactivewindow = XInternAtom(d, "_NET_ACTIVE_WINDOW", False);
 
     Atom real;
     int format;
-    unsigned long extra, n, window;
-    unsigned char *data;
+    unsigned long extra, n;
+    unsigned char *data = NULL;
+    Window window = None;
 
-    if (XGetWindowProperty(d, root, netactivewindow, 0, ~0, False,
-        AnyPropertyType, &real, &format, &n, &extra,
-        &data) != Success && data != 0) {
+    if (XGetWindowProperty(d, root, netactivewindow, 0, 1, False,
+        XA_WINDOW, &real, &format, &n, &extra,
+        &data) != Success) {
         fprintf(stderr, "Could not get netactivewindow property !\n");
+        return None;
     }
 
-    window = *(unsigned long *) data;
-    XFree (data);
+    if (data != NULL) {
+        if (n > 0 && format == 32) {
+            window = *(Window *) data;
+        }
+        XFree(data);
+    }
 
-    if (window == 0) {
+    if (window == None) {
         fprintf(stderr, "No active window !\n");
     }
     return window;
 }
 
-XClassHint* get_window_class_hint(Display* d, Window w) {
-    XClassHint* class = XAllocClassHint();
-
-    Window win = w;
-    Status s = 0;
-    do {
-        s = XGetClassHint(d, w, class);
-        if (s == 0) {
-            Window root = None;
-            Window parent = win;
-            Window *children;
-            unsigned int nchildren;
-            Status s2 = XQueryTree(d, win, &root, &parent, &children, &nchildren);
-            if (s2 > 0) {
-                win = parent;
+// One window of a batched WM_CLASS lookup: the window currently asked about
+// (the original one or an ancestor) and the cookies of its pending replies.
+typedef struct {
+    int index;
+    xcb_window_t win;
+    xcb_get_property_cookie_t prop;
+    xcb_query_tree_cookie_t tree;
+} ClassQuery;
+
+// Returns the class part of a WM_CLASS value ("instance\0class\0"), or NULL.
+static char *wm_class_from_reply(xcb_get_property_reply_t *reply) {
+    int len = xcb_get_property_value_length(reply);
+    const char *value = xcb_get_property_value(reply);
+    const char *sep = memchr(value, '\0', len);
+    if (sep == NULL || sep + 1 >= value + len) {
+        return NULL;
+    }
+    return strndup(sep + 1, value + len - sep - 1);
+}
+
+// Resolves the top-level WM_CLASS of n windows at once, storing a malloc'ed
+// class or NULL in classes[i]. For windows the mirror knows, the WM_CLASS of
+// every ancestor is asked in one batch and the nearest one wins, so the whole
+// list costs a single round trip. Windows the mirror has not seen yet climb
+// the tree a level per batch: the WM_CLASS and QueryTree requests of all of
+// them are sent before any reply is read.
+void resolve_window_classes(Display *d, WindowTree *tree, const Window *windows, int n, char **classes) {
+    xcb_connection_t *c = XGetXCBConnection(d);
+    xcb_window_t root = DefaultRootWindow(d);
+    ClassQuery *pending = malloc(n * sizeof(ClassQuery));
+    int npending = 0;
+    Window *chains = malloc(n * WINDOW_MAX_DEPTH * sizeof(Window));
+    int *depth = malloc(n * sizeof(int));
+    xcb_get_property_cookie_t *cookies = malloc(n * WINDOW_MAX_DEPTH * sizeof(xcb_get_property_cookie_t));
+
+    // Xlib may still hold requests that the replies depend on
+    XFlush(d);
+    for (int i = 0; i < n; i++) {
+        classes[i] = NULL;
+        depth[i] = 0;
+        if (windows[i] == None || windows[i] == root) {
+            continue;
+        }
+        Window *chain = chains + i * WINDOW_MAX_DEPTH;
+        depth[i] = tree != NULL ? wintree_ancestors(tree, windows[i], chain, WINDOW_MAX_DEPTH) : -1;
+        if (depth[i] < 0) {
+            depth[i] = 0;
+            pending[npending].index = i;
+            pending[npending].win = windows[i];
+            npending++;
+        }
+        for (int j = 0; j < depth[i]; j++) {
+            cookies[i * WINDOW_MAX_DEPTH + j] = xcb_get_property(c, 0, chain[j], XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 256);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < depth[i]; j++) {
+            xcb_get_property_reply_t *prop = xcb_get_property_reply(c, cookies[i * WINDOW_MAX_DEPTH + j], NULL);
+            if (classes[i] == NULL && prop != NULL && prop->format == 8) {
+                classes[i] = wm_class_from_reply(prop);
             }
+            free(prop);
+        }
+    }
+    free(cookies);
+    free(depth);
+    free(chains);
+
+    while (npending > 0) {
+        for (int i = 0; i < npending; i++) {
+            pending[i].prop = xcb_get_property(c, 0, pending[i].win, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 256);
+            pending[i].tree = xcb_query_tree(c, pending[i].win);
+        }
+        int next = 0;
+        for (int i = 0; i < npending; i++) {
+            ClassQuery q = pending[i];
+            xcb_get_property_reply_t *prop = xcb_get_property_reply(c, q.prop, NULL);
+            xcb_query_tree_reply_t *tree = xcb_query_tree_reply(c, q.tree, NULL);
+            if (prop != NULL && prop->format == 8) {
+                classes[q.index] = wm_class_from_reply(prop);
+            }
+            if (classes[q.index] == NULL && tree != NULL && tree->parent != XCB_NONE && tree->parent != root) {
+                q.win = tree->parent;
+                pending[next++] = q;
+            }
+            free(prop);
+            free(tree);
+        }
+        npending = next;
+    }
+    free(pending);
+}
+
+ClassCache *new_class_cache() {
+    ClassCache *cache = malloc(sizeof(ClassCache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->index = kh_init(WindowSlot);
+    cache->head = -1;
+    cache->tail = -1;
+    cache->free = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    for (int i = 0; i < CLASS_CACHE_SIZE; i++) {
+        cache->entries[i].window = None;
+        cache->entries[i].class = NULL;
+        cache->entries[i].prev = -1;
+        cache->entries[i].next = i + 1 < CLASS_CACHE_SIZE ? i + 1 : -1;
+    }
+    return cache;
+}
+
+void free_class_cache(ClassCache *cache) {
+    for (int i = 0; i < CLASS_CACHE_SIZE; i++) {
+        free(cache->entries[i].class);
+    }
+    kh_destroy(WindowSlot, cache->index);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static void class_cache_unlink(ClassCache *cache, int slot) {
+    ClassCacheEntry *e = &cache->entries[slot];
+    if (e->prev >= 0) cache->entries[e->prev].next = e->next; else cache->head = e->next;
+    if (e->next >= 0) cache->entries[e->next].prev = e->prev; else cache->tail = e->prev;
+    e->prev = e->next = -1;
+}
+
+static void class_cache_push_front(ClassCache *cache, int slot) {
+    ClassCacheEntry *e = &cache->entries[slot];
+    e->prev = -1;
+    e->next = cache->head;
+    if (cache->head >= 0) cache->entries[cache->head].prev = slot;
+    cache->head = slot;
+    if (cache->tail < 0) cache->tail = slot;
+}
+
+// Looks up the cached class of w. Returns true on a hit and stores a
+// malloc'ed copy of the class (NULL for windows without WM_CLASS) in *class.
+bool class_cache_get(ClassCache *cache, Window w, char **class) {
+    pthread_mutex_lock(&cache->lock);
+    khint_t k = kh_get(WindowSlot, cache->index, w);
+    if (k == kh_end(cache->index)) {
+        cache->misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+    int slot = kh_value(cache->index, k);
+    if (cache->head != slot) {
+        class_cache_unlink(cache, slot);
+        class_cache_push_front(cache, slot);
+    }
+    cache->hits++;
+    *class = cache->entries[slot].class ? strdup(cache->entries[slot].class) : NULL;
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+// Stores class for w, evicting the least recently used entry when full.
+// Takes ownership of class.
+void class_cache_put(ClassCache *cache, Window w, char *class) {
+    int ret;
+    int slot;
+    pthread_mutex_lock(&cache->lock);
+    khint_t k = kh_get(WindowSlot, cache->index, w);
+    if (k != kh_end(cache->index)) {
+        slot = kh_value(cache->index, k);
+        class_cache_unlink(cache, slot);
+    } else {
+        if (cache->free >= 0) {
+            slot = cache->free;
+            cache->free = cache->entries[slot].next;
+        } else {
+            slot = cache->tail;
+            class_cache_unlink(cache, slot);
+            kh_del(WindowSlot, cache->index, kh_get(WindowSlot, cache->index, cache->entries[slot].window));
         }
-    } while (win != DefaultRootWindow(d) && s == 0);
+        k = kh_put(WindowSlot, cache->index, w, &ret);
+        kh_value(cache->index, k) = slot;
+    }
+    free(cache->entries[slot].class);
+    cache->entries[slot].window = w;
+    cache->entries[slot].class = class;
+    class_cache_push_front(cache, slot);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Drops the cached class of w, if any.
+void class_cache_invalidate(ClassCache *cache, Window w) {
+    pthread_mutex_lock(&cache->lock);
+    khint_t k = kh_get(WindowSlot, cache->index, w);
+    if (k == kh_end(cache->index)) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    int slot = kh_value(cache->index, k);
+    kh_del(WindowSlot, cache->index, k);
+    class_cache_unlink(cache, slot);
+    free(cache->entries[slot].class);
+    cache->entries[slot].class = NULL;
+    cache->entries[slot].window = None;
+    cache->entries[slot].next = cache->free;
+    cache->free = slot;
+    pthread_mutex_unlock(&cache->lock);
+}
 
-    if (s > 0) {
+// Returns a malloc'ed copy of the top-level WM_CLASS of w, asking the server
+// on d only when it is not cached yet.
+char *get_cached_window_class(App *app, Display *d, Window w) {
+    char *class = NULL;
+    if (class_cache_get(app->class_cache, w, &class)) {
         return class;
     }
-    return 0;
+    resolve_window_classes(d, app->tree, &w, 1, &class);
+    class_cache_put(app->class_cache, w, class ? strdup(class) : NULL);
+    return class;
 }
 
-unsigned char * get_window_class(Display *d, Window w) {
-    Atom real;
-    int format;
-    unsigned long extra, n;
-    unsigned char *data = NULL;
+// Records w as the focused window and resolves its class, so the keypress
+// path only has to read app->focus_window and app->focus_class.
+void set_focus_window(App *app, Window w) {
+    free(app->focus_class);
+    app->focus_class = NULL;
+    app->focus_window = w;
+    atomic_store_explicit(&app->shared_focus, w, memory_order_relaxed);
+    if (w != None) {
+        uint64_t start = now_ns();
+        app->focus_class = get_cached_window_class(app, app->ctrl_conn, w);
+        hist_record(&app->latency[STAGE_CLASS], now_ns() - start);
+    }
+    app->focus_class_id = dispatch_class_id(app->dispatch, app->focus_class);
+    if (app->debug) fprintf(stderr, "Focus is now %ld, %s\n", w, app->focus_class);
+    if (app->lazy_grabs && w != None) {
+        // the window worker grabs it if this is its first focus. We hold
+        // the ctrl_conn lock the worker grabs under, so never wait for room
+        // in the ring; the worker picks the window up after its next
+        // event instead
+        RecordedEvent focus = { FocusIn, 0, 0, w, { None }, now_ns() };
+        if (!try_push_window_event(app, &focus)) {
+            atomic_store_explicit(&app->focus_rescan, w, memory_order_relaxed);
+        }
+    }
+}
 
-    Window win = w;
-    while (win != DefaultRootWindow(d) && data == NULL) {
-        Status gs = XGetWindowProperty(d, win, XA_WM_CLASS, 0, ~0, False, AnyPropertyType, &real, &format, &n, &extra, &data);
-        if (gs != Success) {
-            Window root = None;
-            Window parent = win;
-            Window *children;
-            unsigned int nchildren;
-            Status s = XQueryTree(d, win, &root, &parent, &children, &nchildren);
-            if (s > 0) {
-                win = parent;
-            }
+// Sets up the empty window mirror. Substructure events of the root are
+// selected on window_conn, so a window storm never queues up on ctrl_conn.
+// The mirror is filled by load_window_tree once the window context records.
+void init_window_tracking(App *app) {
+    Display *d = app->window_conn;
+    app->root = DefaultRootWindow(d);
+    app->net_client_list = XInternAtom(d, "_NET_CLIENT_LIST", True);
+    kv_init(app->clients);
+    XSelectInput(d, app->root, SubstructureNotifyMask);
+    app->tree = wintree_new(app->root);
+}
+
+// Notes that the window context is recording, or failed to, and wakes
+// load_window_tree.
+static void mark_window_recording(App *app) {
+    pthread_mutex_lock(&app->window_start_lock);
+    app->window_recording = true;
+    pthread_cond_signal(&app->window_started);
+    pthread_mutex_unlock(&app->window_start_lock);
+}
+
+// Loads the window mirror once the window context records. Changes made
+// while loading are already queued for the window worker, which applies
+// them on top of the snapshot, so none falls in between.
+void load_window_tree(App *app) {
+    pthread_mutex_lock(&app->window_start_lock);
+    while (!app->window_recording) {
+        pthread_cond_wait(&app->window_started, &app->window_start_lock);
+    }
+    pthread_mutex_unlock(&app->window_start_lock);
+    wintree_load(app->tree, app->window_conn);
+}
+
+// Starts tracking focus from _NET_ACTIVE_WINDOW changes on the root window.
+// Without an EWMH window manager, FocusIn events are used instead.
+void init_focus_tracking(App *app) {
+    Display *d = app->ctrl_conn;
+    app->net_active_window = XInternAtom(d, "_NET_ACTIVE_WINDOW", True);
+    app->focus_window = None;
+    atomic_init(&app->shared_focus, None);
+    atomic_init(&app->focus_rescan, None);
+    app->focus_class = NULL;
+
+    XSelectInput(d, app->root, PropertyChangeMask);
+    if (app->net_active_window != None) {
+        set_focus_window(app, get_active_window(d, app->net_active_window));
+    } else {
+        fprintf(stderr, "No _NET_ACTIVE_WINDOW support, tracking focus from FocusIn\n");
+        set_focus_window(app, get_input_focus_window(d));
+    }
+}
+
+// Grabs keycode with modifiers on w. The XInput2 backend grabs the Lock and
+// NumLock variants in the same request, core grabs are exact.
+void grab_hotkey(App *app, int keycode, unsigned int modifiers, Window w) {
+    Display *d = app->ctrl_conn;
+    if (app->backend == BACKEND_XI2) {
+        unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+        XIEventMask mask = { XIAllMasterDevices, sizeof(mask_bits), mask_bits };
+        XISetMask(mask_bits, XI_KeyPress);
+        XISetMask(mask_bits, XI_KeyRelease);
+        XIGrabModifiers mods[] = {
+            { modifiers, 0 },
+            { modifiers | LockMask, 0 },
+            { modifiers | Mod2Mask, 0 },
+            { modifiers | LockMask | Mod2Mask, 0 },
+        };
+        XIGrabKeycode(d, XIAllMasterDevices, keycode, w, XIGrabModeAsync, XIGrabModeAsync, False, &mask, 4, mods);
+    } else {
+        XGrabKey(d, keycode, modifiers, w, False, GrabModeAsync, GrabModeAsync);
+    }
+}
+
+// Drops the grab of keycode with modifiers on w, the counterpart of
+// grab_hotkey.
+void ungrab_hotkey(App *app, int keycode, unsigned int modifiers, Window w) {
+    Display *d = app->ctrl_conn;
+    if (app->backend == BACKEND_XI2) {
+        XIGrabModifiers mods[] = {
+            { modifiers, 0 },
+            { modifiers | LockMask, 0 },
+            { modifiers | Mod2Mask, 0 },
+            { modifiers | LockMask | Mod2Mask, 0 },
+        };
+        XIUngrabKeycode(d, XIAllMasterDevices, keycode, w, 4, mods);
+    } else {
+        XUngrabKey(d, keycode, modifiers, w);
+    }
+}
+
+static XErrorHandler default_error_handler;
+
+// Grabs and ungrabs are queued without waiting for replies, so a window can
+// be gone by the time they reach the server: BadWindow from them only means
+// the grabs went with the window. Every other error goes to Xlib's handler.
+static int grab_error_handler(Display *d, XErrorEvent *error) {
+    bool grab_request = error->request_code == X_GrabKey || error->request_code == X_UngrabKey
+        || (app->backend == BACKEND_XI2 && error->request_code == app->xi_opcode);
+    if (error->error_code == BadWindow && grab_request) {
+        if (app->debug) fprintf(stderr, "Window %ld went away before its grabs\n", error->resourceid);
+        return 0;
+    }
+    return default_error_handler(d, error);
+}
+
+GrabRegistry *new_grab_registry() {
+    GrabRegistry *registry = malloc(sizeof(GrabRegistry));
+    registry->windows = kh_init(GrabSets);
+    registry->scratch = NULL;
+    registry->scratch_cap = 0;
+    registry->grabs = 0;
+    registry->ungrabs = 0;
+    return registry;
+}
+
+void free_grab_registry(GrabRegistry *registry) {
+    for (khint_t k = kh_begin(registry->windows); k != kh_end(registry->windows); k++) {
+        if (kh_exist(registry->windows, k)) {
+            free(kh_value(registry->windows, k).keys);
         }
     }
-    if (data != NULL) {
+    kh_destroy(GrabSets, registry->windows);
+    free(registry->scratch);
+    free(registry);
+}
+
+// Forgets the grabs on w without ungrabbing, for windows the server has
+// already destroyed.
+void grab_registry_forget(GrabRegistry *registry, Window w) {
+    khint_t k = kh_get(GrabSets, registry->windows, w);
+    if (k != kh_end(registry->windows)) {
+        free(kh_value(registry->windows, k).keys);
+        kh_del(GrabSets, registry->windows, k);
     }
-    return data;
 }
 
-void recurse_window(Display *d, Window w, void (*cb)(Display *d, void *user_data, Window w), void *user_data) {
-    Window root = None;
-    Window parent = w;
-    Window *children;
-    unsigned int nchildren;
-    cb(d, user_data, w);
-	Status s = XQueryTree(d, w, &root, &parent, &children, &nchildren);
-	if (s > 0) {
-        if (children != NULL) {
-            for (int i = 0; i < nchildren; i++) {
-                recurse_window(d, children[i], cb, user_data);
+// Fills the registry scratch with the hotkeys that apply to windows of class,
+// in GrabSet order. A window without a class only gets the global hotkeys.
+static int wanted_grabs(App *app, const char *class) {
+    GrabRegistry *registry = app->grabs;
+    const Dispatch *dispatch = app->window_dispatch;
+    int class_id = dispatch_class_id(dispatch, class);
+    int n = 0;
+    // columns below 8 are button-only hotkeys, grabbing keycode 0 would be
+    // AnyKey
+    for (int keycode = 8; keycode < 256; keycode++) {
+        int row = dispatch->key_row[keycode];
+        if (row == 0) {
+            continue;
+        }
+        for (unsigned int modifiers = 0; modifiers < 256; modifiers++) {
+            int slot = dispatch->rows[row - 1][modifiers];
+            if (slot == 0) {
+                continue;
+            }
+            const Binding *b = &dispatch->bindings[slot - 1];
+            if (b->any < 0 && dispatch_target(dispatch, b, class_id) == NULL) {
+                continue;
+            }
+            if (n == registry->scratch_cap) {
+                registry->scratch_cap = registry->scratch_cap ? registry->scratch_cap * 2 : 64;
+                registry->scratch = realloc(registry->scratch, registry->scratch_cap * sizeof(unsigned short));
             }
+            registry->scratch[n++] = keycode << 8 | modifiers;
         }
     }
-    if (children != NULL) {
-        XFree(children);
+    return n;
+}
+
+// Brings the grabs on w in line with the hotkeys that apply to class,
+// issuing only the grabs and ungrabs that differ from what w already holds.
+void grab_keys_for_class(App *app, Window w, const char *class) {
+    GrabRegistry *registry = app->grabs;
+    int n = wanted_grabs(app, class);
+    khint_t k = kh_get(GrabSets, registry->windows, w);
+    GrabSet held = { NULL, 0 };
+    if (k != kh_end(registry->windows)) {
+        held = kh_value(registry->windows, k);
+    }
+
+    const unsigned short *want = registry->scratch;
+    int i = 0, j = 0, added = 0, removed = 0;
+    // only requests, no replies: the injector waits at most for one window's
+    // worth of them to be buffered
+    XLockDisplay(app->ctrl_conn);
+    while (i < held.n || j < n) {
+        if (j == n || (i < held.n && held.keys[i] < want[j])) {
+            ungrab_hotkey(app, held.keys[i] >> 8, held.keys[i] & 0xFF, w);
+            removed++;
+            i++;
+        } else if (i == held.n || want[j] < held.keys[i]) {
+            grab_hotkey(app, want[j] >> 8, want[j] & 0xFF, w);
+            added++;
+            j++;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    if (added || removed) {
+        XFlush(app->ctrl_conn);
+    }
+    XUnlockDisplay(app->ctrl_conn);
+    registry->grabs += added;
+    registry->ungrabs += removed;
+    if (app->debug && (added || removed)) {
+        fprintf(stderr, "Grabs for window %ld (%s): +%d -%d, %d held\n", w, class, added, removed, n);
     }
+    // windows with nothing to grab are kept too, so a later WM_CLASS change
+    // or reload still syncs them
+    if (k == kh_end(registry->windows)) {
+        int ret;
+        k = kh_put(GrabSets, registry->windows, w, &ret);
+    } else if (added == 0 && removed == 0) {
+        return;
+    }
+    if (n == 0) {
+        free(held.keys);
+        held.keys = NULL;
+    } else {
+        held.keys = realloc(held.keys, n * sizeof(unsigned short));
+        memcpy(held.keys, want, n * sizeof(unsigned short));
+    }
+    held.n = n;
+    kh_value(registry->windows, k) = held;
 }
 
 void grab_all_keys_for_window(void *tmp, Window w) {
     App *app = (App*) tmp;
-    Display *d = app->ctrl_conn;
-    XClassHint* class_hint = get_window_class_hint(d, w);
-    char *class =  class_hint->res_class;
-    fprintf(stderr, "Grab all keys for window %ld, %s, %s\n", w, class_hint->res_class, class_hint->res_name);
-    for (khint_t k = kh_begin(app->config); k != kh_end(app->config); ++k) {
-        if (kh_exist(app->config, k)) {
-            Hotkey *from = short_to_hotkey(kh_key(app->config, k));
-            int keycode;
-            unsigned int modifiers;
-            hotkey_to_grab_key(*from, &keycode, &modifiers);
-            free(from);
-            khash_t(Mappings)* mapping = kh_value(app->config, k);
-            // search for window itself !!!
-            khint_t kapp = kh_get(Mappings, mapping, class);
-            if (kapp != kh_end(mapping)) {
-                // SPECIFIC HOTKEY
-                fprintf(stderr, "Got specific hotkey for window %s \n", class);
-                XGrabKey(d, keycode, modifiers, w, False, GrabModeAsync, GrabModeAsync);
-            } else {
-                khint_t kall = kh_get(Mappings, mapping, "*");
-                if (kall != kh_end(mapping)) {
-                    // GLOBAL HOTKEY
-                    fprintf(stderr, "Got ALL hotkey for window %s \n", class);
-                    XGrabKey(d, keycode, modifiers, w, False, GrabModeAsync, GrabModeAsync);
-                }
-            }
+    char *class = get_cached_window_class(app, app->window_conn, w);
+    grab_keys_for_class(app, w, class);
+    free(class);
+}
+
+// Syncs the grabs of n windows, resolving their classes in one pipelined
+// lookup. The grabs need no replies and all leave in the next flush.
+static void grab_windows(App *app, const Window *windows, int n) {
+    char **classes = malloc(n * sizeof(char *));
+    resolve_window_classes(app->window_conn, app->tree, windows, n, classes);
+    for (int i = 0; i < n; i++) {
+        grab_keys_for_class(app, windows[i], classes[i]);
+        free(classes[i]);
+    }
+    free(classes);
+}
+
+static int compare_windows(const void *a, const void *b) {
+    Window wa = *(const Window *)a;
+    Window wb = *(const Window *)b;
+    return wa < wb ? -1 : wa > wb;
+}
+
+// Reads _NET_CLIENT_LIST again and merges it against app->clients. Clients
+// that appeared are stored in added, clients that went away lose their
+// cached class.
+void update_client_list(App *app, WindowVec *added) {
+    unsigned long nitems = 0;
+    Window *list = get_wm_window_list(app->window_conn, app->net_client_list, &nitems);
+    WindowVec now;
+    kv_init(now);
+    kv_resize(Window, now, nitems > 0 ? nitems : 1);
+    if (list != NULL) {
+        memcpy(now.a, list, nitems * sizeof(Window));
+        now.n = nitems;
+        XFree(list);
+    }
+    qsort(now.a, now.n, sizeof(Window), compare_windows);
+
+    int removed = 0;
+    size_t i = 0, j = 0;
+    while (i < kv_size(app->clients) || j < kv_size(now)) {
+        if (j == kv_size(now) || (i < kv_size(app->clients) && kv_A(app->clients, i) < kv_A(now, j))) {
+            class_cache_invalidate(app->class_cache, kv_A(app->clients, i));
+            removed++;
+            i++;
+        } else if (i == kv_size(app->clients) || kv_A(now, j) < kv_A(app->clients, i)) {
+            kv_push(Window, *added, kv_A(now, j));
+            j++;
+        } else {
+            i++;
+            j++;
         }
     }
-    free(class);
-    free(class_hint);
+    if (app->debug) fprintf(stderr, "Client list: %zu clients, +%zu -%d\n", kv_size(now), kv_size(*added), removed);
+    kv_destroy(app->clients);
+    app->clients = now;
 }
 
+// Grabs keys on the clients that appeared since the last call, every client
+// the first time.
 void grab_all_keys(App *app) {
-    fprintf(stderr, "Grabbing all keys for all apps\n");
-    Display *d = app->ctrl_conn;
-    unsigned long nitems;
-    Window* windows = get_wm_window_list(d, &nitems);
+    WindowVec added;
+    kv_init(added);
+    update_client_list(app, &added);
+    grab_windows(app, added.a, kv_size(added));
+    kv_destroy(added);
+}
+
+// Fills ranges with what the key context records and returns how many there
+// are. Keys and buttons are only recorded by the record backend and only when
+// input is set, which the config decides; MotionNotify and the crossing and
+// exposure events never are. FocusIn is only needed without
+// _NET_ACTIVE_WINDOW. Free the ranges with XFree.
+int key_record_ranges(App *app, bool input, XRecordRange **ranges) {
+    XRecordRange *input_range = XRecordAllocRange();
+    XRecordRange *prop_range = XRecordAllocRange();
+    XRecordRange *mapping_range = XRecordAllocRange();
+    XRecordRange *xkb_range = XRecordAllocRange();
+    if (app->backend == BACKEND_RECORD && input) {
+        input_range->device_events.first = KeyPress;
+        input_range->device_events.last = ButtonRelease;
+    }
+    if (app->net_active_window == None) {
+        input_range->delivered_events.first = FocusIn;
+        input_range->delivered_events.last = FocusIn;
+    }
+    // WM_CLASS and _NET_ACTIVE_WINDOW changes move the focus
+    prop_range->delivered_events.first = PropertyNotify;
+    prop_range->delivered_events.last = PropertyNotify;
+    // keyboard mapping changes rebuild the keycode role table
+    mapping_range->delivered_events.first = MappingNotify;
+    mapping_range->delivered_events.last = MappingNotify;
+    xkb_range->delivered_events.first = app->xkb_event_base;
+    xkb_range->delivered_events.last = app->xkb_event_base;
+    ranges[0] = input_range;
+    ranges[1] = prop_range;
+    ranges[2] = mapping_range;
+    ranges[3] = xkb_range;
+    return KEY_RANGE_MAX;
+}
+
+// Points the key context at what the dispatch table of the injector needs,
+// so an empty config records no keystrokes at all. Any hotkey needs the key
+// events, if only to follow its modifiers. Before the context exists this
+// only notes what it will be created with.
+void update_key_ranges(App *app) {
+    int input = app->dispatch->nbindings > 0;
+    if (input == app->record_input) {
+        return;
+    }
+    app->record_input = input;
+    if (app->record_ctx == 0 || app->backend != BACKEND_RECORD) {
+        return;
+    }
+    XRecordRange *ranges[KEY_RANGE_MAX];
+    int n = key_record_ranges(app, input, ranges);
+    XRecordClientSpec spec = XRecordAllClients;
+    // registering clients again replaces their ranges
+    XRecordRegisterClients(app->ctrl_conn, app->record_ctx, 0, &spec, 1, ranges, n);
+    XFlush(app->ctrl_conn);
+    for (int i = 0; i < n; i++) {
+        XFree(ranges[i]);
+    }
+    if (app->debug) fprintf(stderr, "Recording keys and buttons: %d\n", input);
+}
+
+// Moves the injector onto table: the focused class is re-interned against
+// the new bindings and the key context follows the inputs they use.
+void switch_table(App *app, ConfigTable *table) {
+    app->dispatch = table->dispatch;
+    app->table_generation = table->generation;
+    app->focus_class_id = dispatch_class_id(app->dispatch, app->focus_class);
+    update_key_ranges(app);
+}
+
+// Moves the window worker onto table: every window we hold grabs on plus the
+// current client list is synced, so a reload only costs the grabs that
+// changed.
+void switch_window_table(App *app, ConfigTable *table) {
+    bool first = app->window_generation == 0;
+    app->window_dispatch = table->dispatch;
+    app->window_generation = table->generation;
+    if (first || app->backend == BACKEND_EVDEV) {
+        return;
+    }
+    khash_t(GrabSets) *held = app->grabs->windows;
+    unsigned long nitems = 0;
+    Window *clients = NULL;
+    Window focus = atomic_load_explicit(&app->shared_focus, memory_order_relaxed);
+    if (app->lazy_grabs) {
+        // windows that had nothing to grab are looked at again on their
+        // next focus, the focused one right away
+        kh_clear(WindowSet, app->focused);
+        if (focus != None) {
+            int ret;
+            kh_put(WindowSet, app->focused, focus, &ret);
+            clients = &focus;
+            nitems = 1;
+        }
+    } else {
+        clients = app->clients.a;
+        nitems = kv_size(app->clients);
+    }
+    Window *windows = malloc((kh_size(held) + nitems) * sizeof(Window));
+    int n = 0;
+    for (khint_t k = kh_begin(held); k != kh_end(held); k++) {
+        if (kh_exist(held, k)) {
+            windows[n++] = kh_key(held, k);
+        }
+    }
     for (int i = 0; i < nitems; i++) {
-        grab_all_keys_for_window((void *)app, windows[i]);
+        if (kh_get(GrabSets, held, clients[i]) == kh_end(held)) {
+            windows[n++] = clients[i];
+        }
     }
+    grab_windows(app, windows, n);
     free(windows);
 }
 
-void restore_current_mods(Display *d, Hotkey h) {
-    fprintf(stderr, "Restoring current mods to %d, %d, %d, %d\n", h.shift, h.control, h.alt, h.super);
-    if (h.shift) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Shift_L), True, 0);
-    if (h.control) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Control_L), True, 0);
-    if (h.alt) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Alt_L), True, 0);
-    if (h.super) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Super_L), True, 0);
-}
-void release_current(Display *d, Hotkey h) {
-    fprintf(stderr, "RELEASING current mods to %d, %d, %d, %d\n", h.shift, h.control, h.alt, h.super);
-    if (h.shift) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Shift_L), False, 0);
-    if (h.control) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Control_L), False, 0);
-    if (h.alt) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Alt_L), False, 0);
-    if (h.super) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Super_L), False, 0);
-    if (h.key > 0) XTestFakeKeyEvent(d, h.key, False, 0);
-}
-
-void key_action(Display *d, Hotkey h) {
-    if (h.shift) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Shift_L), True, 0);
-    if (h.control) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Control_L), True, 0);
-    if (h.alt) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Alt_L), True, 0);
-    if (h.super) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Super_L), True, 0);
-    if (h.key > 0) {
-        XTestFakeKeyEvent(d, h.key, True, 0);
-        XTestFakeKeyEvent(d, h.key, False, 0);
-    } else if (h.button > 0) {
-        // Window root, child;
-        // int rootX, rootY, winX, winY;
-        // unsigned int mask;
-        // XQueryPointer(d, RootWindow(d, 0), &root, &child, &rootX, &rootY, &winX, &winY, &mask);
-        XTestFakeButtonEvent (d, h.button, True,  0);
-        XTestFakeButtonEvent (d, h.button, False, 0);
-    }
-    if (h.super) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Super_L), False, 0);
-    if (h.alt) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Alt_L), False, 0);
-    if (h.control) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Control_L), False, 0);
-    if (h.shift) XTestFakeKeyEvent(d, XKeysymToKeycode(d, XK_Shift_L), False, 0);
-}
-
-void execute(App* app) {
-    unsigned short config_key = hotkey_to_short(*app->current);
-    khint_t hotkey_found = kh_get(Config, app->config, config_key);
-    if (hotkey_found != kh_end(app->config)) {
-        khash_t(Mappings)* mapping = kh_value(app->config, hotkey_found);
-        khint_t any_found = kh_get(Mappings, mapping, "*");
-        if (any_found != kh_end(mapping)) {
-            fprintf(stderr, "Found remapping for ANY\n");
-            app->handling = 1;
-            Hotkey *to = kh_value(mapping, any_found);
-            XTestGrabControl(app->ctrl_conn, True);
-            release_current(app->ctrl_conn, *app->current);
-            XFlush(app->ctrl_conn);
-            key_action(app->ctrl_conn, *to);
-            XFlush(app->ctrl_conn);
-            restore_current_mods(app->ctrl_conn, *app->current);
-            app->current->key = 0;
-            XFlush(app->ctrl_conn);
-            app->handling = 0;
-        } else {
-            Window w = get_active_window(app->ctrl_conn);
-            if (w == None) {
-                fprintf(stderr, "Could not get focused window !\n");
-            } else {
-                XClassHint* class_hint = get_window_class_hint(app->ctrl_conn, w);
-                char* class = class_hint->res_class;
-                if (class == NULL) {
-                    fprintf(stderr, "Could not get focused window class !\n");
-                } else {
-                    khint_t app_found = kh_get(Mappings, mapping, class);
-                    if (app_found != kh_end(mapping)) {
-                        fprintf(stderr, "Found remapping for app %s\n", class);
-                        app->handling = 1;
-                        Hotkey current_copy = *app->current;
-                        Hotkey *to = kh_value(mapping, app_found);
-                        XTestGrabControl(app->ctrl_conn, True);
-                        release_current(app->ctrl_conn, current_copy);
-                        XFlush(app->ctrl_conn);
-                        key_action(app->ctrl_conn, *to);
-                        XFlush(app->ctrl_conn);
-                        restore_current_mods(app->ctrl_conn, current_copy);
-                        XFlush(app->ctrl_conn);
-                        //*app->current = current_copy;
-                        app->current->key = 0;
-                        app->handling = 0;
-                    }
-                }
-                XFree(class_hint);
-                XFree(class);
-            }
+// A planned injection: the synthetic events that take the server from the
+// physical state (held modifiers plus the source key) to the target hotkey
+// and back. It is sent as one batch, so all of its requests leave in a
+// single write and the server sees them back to back.
+#define INJECT_MAX_EVENTS 40
+
+typedef enum {
+    FAKE_KEY,
+    FAKE_BUTTON,
+    FAKE_LATCH,
+} FakeKind;
+
+typedef struct {
+    unsigned char kind;
+    unsigned char is_press;
+    unsigned short code;
+} FakeEvent;
+
+typedef struct {
+    FakeEvent events[INJECT_MAX_EVENTS];
+    int count;
+} Injection;
+
+static void plan_event(Injection *plan, FakeKind kind, unsigned int code, Bool is_press) {
+    if (plan->count == INJECT_MAX_EVENTS) {
+        return;
+    }
+    FakeEvent *e = &plan->events[plan->count++];
+    e->kind = kind;
+    e->is_press = is_press;
+    e->code = code;
+}
+
+static void plan_mods(Injection *plan, const Keymap *keymap, unsigned int mods, Bool is_press) {
+    for (int i = 0; i < 8; i++) {
+        int bit = is_press ? i : 7 - i;
+        if ((mods & (1 << bit)) && keymap->mod_keycode[bit] != 0) {
+            plan_event(plan, FAKE_KEY, keymap->mod_keycode[bit], is_press);
+        }
+    }
+}
+
+// Releases, or presses again, every held modifier key that sets one of mods.
+static void plan_held_mods(Injection *plan, const Keymap *keymap, const unsigned char *mod_down, unsigned int mods, Bool is_press) {
+    for (int kc = 8; kc < 256 && mods != 0; kc++) {
+        if (mod_down[kc] && (keymap->role[kc] & mods)) {
+            plan_event(plan, FAKE_KEY, kc, is_press);
+        }
+    }
+}
+
+// Recomputes the held modifier mask after key_code went down or up, from
+// every modifier key still held: releasing Control_R while Control_L is down
+// keeps ControlMask.
+static void track_modifier(App *app, KeyCode key_code, bool is_press) {
+    app->mod_down[key_code] = is_press;
+    unsigned int mods = 0;
+    for (int kc = 8; kc < 256; kc++) {
+        if (app->mod_down[kc]) {
+            mods |= app->keymap.role[kc];
+        }
+    }
+    app->current->mods = mods;
+}
+
+// Plans the remap of current to target, touching only the modifiers that
+// differ between the two. The ones to drop are released and restored through
+// the keys in mod_down that hold them. With latch, modifiers the target adds
+// are latched through XKB for the target key instead of being pressed and
+// released.
+void plan_remap(Injection *plan, const Keymap *keymap, const unsigned char *mod_down, Hotkey current, Hotkey target, bool latch) {
+    unsigned int removed = current.mods & ~target.mods;
+    unsigned int added = target.mods & ~current.mods;
+    plan->count = 0;
+
+    plan_held_mods(plan, keymap, mod_down, removed, False);
+    if (current.key > 0) plan_event(plan, FAKE_KEY, current.key, False);
+
+    if (latch && added != 0) {
+        plan_event(plan, FAKE_LATCH, added, True);
+    } else {
+        plan_mods(plan, keymap, added, True);
+    }
+    if (target.key > 0) {
+        plan_event(plan, FAKE_KEY, target.key, True);
+        plan_event(plan, FAKE_KEY, target.key, False);
+    } else if (target.button > 0) {
+        plan_event(plan, FAKE_BUTTON, target.button, True);
+        plan_event(plan, FAKE_BUTTON, target.button, False);
+    }
+    if (!latch) {
+        plan_mods(plan, keymap, added, False);
+    }
+
+    plan_held_mods(plan, keymap, mod_down, removed, True);
+}
+
+long elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+// Queues every event of plan on d and writes them with a single flush.
+// Keys and buttons go straight into the XCB output queue; a latch is an Xlib
+// XKB request and is flushed on its own so it stays in order.
+// Returns the time spent, in nanoseconds.
+long send_injection(Display *d, const Injection *plan) {
+    struct timespec start, end;
+    xcb_connection_t *c = XGetXCBConnection(d);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < plan->count; i++) {
+        const FakeEvent *e = &plan->events[i];
+        switch (e->kind) {
+            case FAKE_KEY:
+                xcb_test_fake_input(c, e->is_press ? XCB_KEY_PRESS : XCB_KEY_RELEASE, e->code, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+                break;
+            case FAKE_BUTTON:
+                xcb_test_fake_input(c, e->is_press ? XCB_BUTTON_PRESS : XCB_BUTTON_RELEASE, e->code, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+                break;
+            case FAKE_LATCH:
+                XkbLatchModifiers(d, XkbUseCoreKbd, e->code, e->code);
+                XFlush(d);
+                break;
+        }
+    }
+    xcb_flush(c);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ns(&start, &end);
+}
+
+// Counts the key and button events of plan as echoes to drop. Called before
+// the plan is sent, so intercept() can never see an echo first.
+void expect_echoes(EchoFilter *echoes, const Injection *plan) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < plan->count; i++) {
+        const FakeEvent *e = &plan->events[i];
+        if (e->kind == FAKE_LATCH) {
+            continue;
+        }
+        int type = (e->kind == FAKE_KEY ? KeyPress : ButtonPress) + !e->is_press - KeyPress;
+        atomic_store_explicit(&echoes->stamp[type][e->code], now, memory_order_relaxed);
+        atomic_fetch_add_explicit(&echoes->pending[type][e->code], 1, memory_order_release);
+    }
+}
+
+// Returns true and uncounts one echo if an event of type with detail is one
+// we injected. Runs on the input reader thread.
+bool take_echo(EchoFilter *echoes, int type, unsigned char detail, uint64_t stamp) {
+    atomic_uint *pending = &echoes->pending[type - KeyPress][detail];
+    unsigned int n = atomic_load_explicit(pending, memory_order_acquire);
+    while (n > 0) {
+        // signed: the injector may count the slot again after we stamped
+        // the event, that slot is fresh, not stale
+        int64_t age = (int64_t)(stamp - atomic_load_explicit(&echoes->stamp[type - KeyPress][detail], memory_order_relaxed));
+        if (age > (int64_t)ECHO_TIMEOUT_NS) {
+            atomic_store_explicit(pending, 0, memory_order_relaxed);
+            return false;
+        }
+        if (atomic_compare_exchange_weak_explicit(pending, &n, n - 1, memory_order_acquire, memory_order_acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// evdev codes are X keycodes minus 8, buttons 4 and 5 are wheel steps
+static int fake_to_input_event(struct input_event *ev, const FakeEvent *e) {
+    if (e->kind == FAKE_KEY) {
+        input_event_set(ev, EV_KEY, e->code - 8, e->is_press);
+        return 1;
+    }
+    if (e->kind != FAKE_BUTTON) {
+        return 0;
+    }
+    switch (e->code) {
+        case 1: input_event_set(ev, EV_KEY, BTN_LEFT, e->is_press); return 1;
+        case 2: input_event_set(ev, EV_KEY, BTN_MIDDLE, e->is_press); return 1;
+        case 3: input_event_set(ev, EV_KEY, BTN_RIGHT, e->is_press); return 1;
+        case 4: input_event_set(ev, EV_REL, REL_WHEEL, 1); return e->is_press;
+        case 5: input_event_set(ev, EV_REL, REL_WHEEL, -1); return e->is_press;
+    }
+    return 0;
+}
+
+// Writes plan to the uinput keyboard in a single write, each event followed
+// by its own SYN_REPORT so X sees them as separate transitions.
+// Returns the time spent, in nanoseconds.
+long send_uinput_injection(int fd, const Injection *plan) {
+    struct input_event events[INJECT_MAX_EVENTS * 2];
+    int n = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < plan->count; i++) {
+        if (fake_to_input_event(&events[n], &plan->events[i])) {
+            input_event_set(&events[n + 1], EV_SYN, SYN_REPORT, 0);
+            n += 2;
         }
     }
+    if (n > 0 && write(fd, events, n * sizeof(struct input_event)) < 0) {
+        fprintf(stderr, "uinput write failed: %s\n", strerror(errno));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ns(&start, &end);
+}
+
+// Passes a key we do not remap on to the uinput keyboard.
+void forward_key(App *app, KeyCode key_code, int value) {
+    struct input_event events[2];
+    input_event_set(&events[0], EV_KEY, key_code - 8, value);
+    input_event_set(&events[1], EV_SYN, SYN_REPORT, 0);
+    if (write(app->uinput_fd, events, sizeof(events)) < 0) {
+        fprintf(stderr, "uinput write failed: %s\n", strerror(errno));
+    }
+}
+
+void remap(App *app, const Hotkey *to) {
+    Hotkey current_copy = *app->current;
+    Injection plan;
+    plan_remap(&plan, &app->keymap, app->mod_down, current_copy, *to, app->latch_mods);
+    // uinput output never reaches the grabbed evdev keyboards
+    if (app->backend != BACKEND_EVDEV) {
+        expect_echoes(&app->echoes, &plan);
+    }
+    long ns = app->backend == BACKEND_EVDEV ? send_uinput_injection(app->uinput_fd, &plan) : send_injection(app->ctrl_conn, &plan);
+
+    InjectStats *stats = &app->inject_stats;
+    hist_record(&app->latency[STAGE_INJECT], ns);
+    hist_record(&app->latency[STAGE_TOTAL], now_ns() - app->event_stamp);
+    stats->batches++;
+    stats->events += plan.count;
+    stats->total_ns += ns;
+    if (ns > stats->max_ns) stats->max_ns = ns;
+    if (app->debug) fprintf(stderr, "Injected %d events for mods 0x%02x -> 0x%02x in %ld us\n", plan.count, current_copy.mods, to->mods, ns / 1000);
+
+    app->current->key = 0;
+}
+
+static int x_focus_class_id(void *ctx) {
+    App *app = (App*)ctx;
+    if (app->focus_window == None) {
+        fprintf(stderr, "Could not get focused window !\n");
+    } else if (app->focus_class == NULL) {
+        fprintf(stderr, "Could not get focused window class !\n");
+    }
+    return app->focus_class_id;
+}
+
+static void x_inject(void *ctx, const Target *target) {
+    App *app = (App*)ctx;
+    hist_record(&app->latency[STAGE_LOOKUP], now_ns() - app->lookup_start);
+    if (target->class_id == DISPATCH_NO_CLASS) {
+        fprintf(stderr, "Found remapping for ANY\n");
+    } else {
+        fprintf(stderr, "Found remapping for app %s\n", app->focus_class);
+    }
+    remap(app, &target->to);
+}
+
+// Looks up the current hotkey and injects its target. Returns true when the
+// key was remapped.
+bool execute(App* app) {
+    app->lookup_start = now_ns();
+    if (mapping_execute(app->dispatch, app->current, &app->mapping_backend)) {
+        return true;
+    }
+    hist_record(&app->latency[STAGE_LOOKUP], now_ns() - app->lookup_start);
+    return false;
 }
 
 typedef union {
@@ -511,32 +1710,56 @@ typedef union {
   xConnSetupPrefix setup;
 } XRecordDatum;
 
-void intercept(XPointer user_data, XRecordInterceptData *data) {
-    if (data->category != XRecordFromServer) {
-        XRecordFreeData(data);
-        return;
+// evdev counterpart of the key handling in handle_event. The keyboards are
+// grabbed, so every key that is not remapped is passed on, and the release
+// and repeats of a remapped key are swallowed along with its press.
+void handle_evdev_key(App *app, const RecordedEvent *ev) {
+    KeyCode key_code = ev->detail;
+    bool is_press = ev->type == KeyPress;
+    bool repeat = is_press && app->key_down[key_code];
+    app->key_down[key_code] = is_press;
+
+    unsigned int mod = app->keymap.role[key_code];
+    if (mod != 0) {
+        track_modifier(app, key_code, is_press);
+        if (!repeat) forward_key(app, key_code, is_press);
+    } else if (is_press) {
+        app->current->key = key_code;
+        if (!repeat) {
+            app->key_consumed[key_code] = execute(app);
+            if (!app->key_consumed[key_code]) forward_key(app, key_code, 1);
+        } else if (app->key_consumed[key_code]) {
+            // X never saw the key, so it will not autorepeat the remap for us
+            execute(app);
+        }
+    } else {
+        app->current->key = 0;
+        if (app->key_consumed[key_code]) {
+            app->key_consumed[key_code] = 0;
+        } else {
+            forward_key(app, key_code, 0);
+        }
     }
+}
 
-	App *app = (App*)user_data;
-
-	// mangle data
-    XRecordDatum *datum = (XRecordDatum*) data->data;
-    int event_type = datum->event.u.u.type;
+// Applies one recorded event. Runs on the injector thread, which owns
+// ctrl_conn and all of the focus, keymap and modifier state.
+void handle_event(App *app, const RecordedEvent *ev) {
+    int event_type = ev->type;
 
-	XLockDisplay(app->ctrl_conn);
+    if ((event_type == KeyPress || event_type == KeyRelease) && app->keymap_dirty) {
+        build_keymap(app->ctrl_conn, &app->keymap);
+        app->keymap_dirty = false;
+    }
 
-    if (event_type == KeyPress) {
-        KeyCode key_code  = datum->event.u.u.detail;
-        if (app->debug) fprintf(stderr, "Intercepted key press, key code %d | %d, %ul, %d || %d\n", key_code, data->id_base, data->client_seq, data->category, data->client_swapped, app->handling);
-        KeySym now = XkbKeycodeToKeysym(app->ctrl_conn, key_code, 0, 0);
-        if (now == XK_Shift_L || now == XK_Shift_R) {
-            app->current->shift = true;
-        } else if (now == XK_Control_L || now == XK_Control_R) {
-            app->current->control = true;
-        } else if (now == XK_Alt_L || now == XK_Alt_R) {
-            app->current->alt = true;
-        } else if (now == XK_Super_L || now == XK_Super_R) {
-            app->current->super = true;
+    if (app->backend == BACKEND_EVDEV && (event_type == KeyPress || event_type == KeyRelease)) {
+        handle_evdev_key(app, ev);
+    } else if (event_type == KeyPress) {
+        KeyCode key_code = ev->detail;
+        if (app->debug) fprintf(stderr, "Intercepted key press, key code %d\n", key_code);
+        unsigned int mod = app->keymap.role[key_code];
+        if (mod != 0) {
+            track_modifier(app, key_code, true);
         } else {
             // got modifiers, we can now do it
             app->current->key = key_code;
@@ -544,66 +1767,550 @@ void intercept(XPointer user_data, XRecordInterceptData *data) {
         }
     } else if (event_type == KeyRelease) {
         // reset modifiers
-        KeyCode key_code  = datum->event.u.u.detail;
-        if (app->debug) fprintf(stderr, "Intercepted key release, key code %d | %d, %ul, %d || %d\n", key_code, data->id_base, data->client_seq, data->category, data->client_swapped, app->handling);
-        KeySym now = XkbKeycodeToKeysym(app->ctrl_conn, key_code, 0, 0);
-        if (now == XK_Shift_L || now == XK_Shift_R) {
-            app->current->shift = false;
-        } else if (now == XK_Control_L || now == XK_Control_R) {
-            app->current->control = false;
-        } else if (now == XK_Alt_L || now == XK_Alt_R) {
-            app->current->alt = false;
-        } else if (now == XK_Super_L || now == XK_Super_R) {
-            app->current->super = false;
+        KeyCode key_code = ev->detail;
+        if (app->debug) fprintf(stderr, "Intercepted key release, key code %d\n", key_code);
+        unsigned int mod = app->keymap.role[key_code];
+        if (mod != 0) {
+            track_modifier(app, key_code, false);
         } else {
             // got modifiers, we can now do it
             app->current->key = 0;
         }
     } else if (event_type == ButtonPress) {
-        KeyCode key_code  = datum->event.u.u.detail;
-        app->current->button = key_code;
+        app->current->button = ev->detail;
         //execute(app);
     } else if (event_type == ButtonRelease) {
         app->current->button = 0;
-    } else if (event_type == CreateNotify) {
+    } else if (event_type == PropertyNotify) {
+        if (ev->atom == XA_WM_CLASS) {
+            // the window worker sees it too and fixes the grabs
+            if (ev->window == app->focus_window) {
+                class_cache_invalidate(app->class_cache, ev->window);
+                set_focus_window(app, ev->window);
+            }
+        } else {
+            Window active = get_active_window(app->ctrl_conn, app->net_active_window);
+            if (active != app->focus_window) {
+                set_focus_window(app, active);
+            }
+        }
+    } else if (event_type == MappingNotify) {
+        // every client gets a copy, so only mark the keymap and rebuild it on
+        // the next key event
+        app->keymap_dirty = true;
+    } else if (event_type == FocusIn) {
+        if (ev->window != app->focus_window) {
+            set_focus_window(app, ev->window);
+        }
+    }
+
+    // Events selected on ctrl_conn reach us through the record context, drop
+    // the copies Xlib queued locally so they do not pile up.
+    while (XEventsQueued(app->ctrl_conn, QueuedAlready) > 0) {
+        XEvent xev;
+        XNextEvent(app->ctrl_conn, &xev);
+        if (xev.type == MappingNotify) {
+            XRefreshKeyboardMapping(&xev.xmapping);
+        }
+    }
+}
+
+// Handles a window structure event, or a message, on the window worker.
+// Nothing here is on the keystroke path.
+void handle_window_event(App *app, const RecordedEvent *ev) {
+    int event_type = ev->type;
+    bool grabbing = app->backend != BACKEND_EVDEV;
+
+    if (event_type == CreateNotify) {
+        wintree_add(app->tree, ev->window, ev->parent);
         // attempt bind
-        Window w = datum->event.u.createNotify.window;
-        grab_all_keys_for_window(app, w);
+        if (grabbing && !app->lazy_grabs) {
+            grab_all_keys_for_window(app, ev->window);
+        }
+    } else if (event_type == ReparentNotify) {
+        wintree_add(app->tree, ev->window, ev->parent);
+        // the window may have moved under another top level
+        class_cache_invalidate(app->class_cache, ev->window);
     } else if (event_type == DestroyNotify) {
-        Window w = datum->event.u.destroyNotify.window;
-        // XXX what ?
+        wintree_remove(app->tree, ev->window);
+        class_cache_invalidate(app->class_cache, ev->window);
+        // the server drops the grabs with the window
+        grab_registry_forget(app->grabs, ev->window);
+        if (app->lazy_grabs) {
+            khint_t k = kh_get(WindowSet, app->focused, ev->window);
+            if (k != kh_end(app->focused)) {
+                kh_del(WindowSet, app->focused, k);
+            }
+        }
+    } else if (event_type == PropertyNotify) {
+        if (ev->atom == XA_WM_CLASS) {
+            class_cache_invalidate(app->class_cache, ev->window);
+            if (grabbing && kh_get(GrabSets, app->grabs->windows, ev->window) != kh_end(app->grabs->windows)) {
+                grab_all_keys_for_window(app, ev->window);
+            }
+        } else if (ev->atom == app->net_client_list) {
+            // the client list changed, only the clients that appeared are
+            // grabbed
+            grab_all_keys(app);
+        }
+    } else if (event_type == FocusIn) {
+        // posted by set_focus_window in lazy mode
+        int ret;
+        kh_put(WindowSet, app->focused, ev->window, &ret);
+        if (ret != 0) {
+            grab_all_keys_for_window(app, ev->window);
+        }
+    }
+    // TableChangedEvent needs nothing else, enter_window_table switched
+
+    // drop the substructure events selected on window_conn, they reach us
+    // through the window record context
+    while (XEventsQueued(app->window_conn, QueuedAlready) > 0) {
+        XEvent xev;
+        XNextEvent(app->window_conn, &xev);
+    }
+}
+
+void *window_worker(void *user_data) {
+    App *app = (App*)user_data;
+    RecordedEvent ev;
+
+    if (app->debug) fprintf(stderr, "window worker running...\n");
+    while (ring_pop(app->window_events, &ev) == 0) {
+        enter_window_table(app);
+        handle_window_event(app, &ev);
+        Window focus = atomic_exchange_explicit(&app->focus_rescan, None, memory_order_relaxed);
+        if (focus != None) {
+            RecordedEvent rescan = { FocusIn, 0, 0, focus, { None }, now_ns() };
+            handle_window_event(app, &rescan);
+        }
+        leave_window_table(app);
+    }
+    if (app->debug) fprintf(stderr, "window worker exiting...\n");
+    return NULL;
+}
+
+void *injector(void *user_data) {
+    App *app = (App*)user_data;
+    RecordedEvent ev;
+
+    if (app->debug) fprintf(stderr, "injector running...\n");
+    while (ring_pop(app->events, &ev) == 0) {
+        app->event_stamp = ev.stamp;
+        hist_record(&app->latency[STAGE_QUEUE], now_ns() - ev.stamp);
+        XLockDisplay(app->ctrl_conn);
+        enter_table(app);
+        handle_event(app, &ev);
+        leave_table(app);
+        XUnlockDisplay(app->ctrl_conn);
+    }
+    if (app->debug) fprintf(stderr, "injector exiting...\n");
+    return NULL;
+}
+
+// Hands ev to the injector thread. The time since ev->stamp is the
+// classification cost of the reader.
+void push_event(App *app, const RecordedEvent *ev) {
+    hist_record(&app->latency[STAGE_CLASSIFY], now_ns() - ev->stamp);
+    // the injector is behind: wait for room rather than drop the event
+    while (ring_push(app->events, ev) != 0) {
+        sched_yield();
+    }
+}
+
+// Hands ev to the window worker. Several threads post, so the pushes are
+// serialized; a closed ring drops the event.
+void push_window_event(App *app, const RecordedEvent *ev) {
+    pthread_mutex_lock(&app->window_push_lock);
+    while (ring_push(app->window_events, ev) != 0 && errno == ENOBUFS) {
+        sched_yield();
+    }
+    pthread_mutex_unlock(&app->window_push_lock);
+}
+
+// Posts ev to the window worker without waiting, for the injector while it
+// holds the ctrl_conn lock. Returns false when the ring is full or another
+// thread is posting.
+bool try_push_window_event(App *app, const RecordedEvent *ev) {
+    if (pthread_mutex_trylock(&app->window_push_lock) != 0) {
+        return false;
+    }
+    bool pushed = ring_push(app->window_events, ev) == 0;
+    pthread_mutex_unlock(&app->window_push_lock);
+    return pushed;
+}
+
+// Creates the private window sig_handler sends a ClientMessage to when a
+// reader loop on data_conn has to stop.
+void create_wake_window(App *app) {
+    app->wake_window = XCreateSimpleWindow(app->data_conn, DefaultRootWindow(app->data_conn), 0, 0, 1, 1, 0, 0, 0);
+    XFlush(app->data_conn);
+}
+
+// Sets up the XInput2 backend: raw key and button events of every master
+// are selected on the root window of data_conn, and a private window on the
+// same connection lets sig_handler wake the reader.
+bool init_xi2(App *app) {
+    int dummy;
+    int major = 2, minor = 2;
+    if (!XQueryExtension(app->data_conn, "XInputExtension", &app->xi_opcode, &dummy, &dummy)
+            || XIQueryVersion(app->data_conn, &major, &minor) != Success
+            || XIQueryVersion(app->ctrl_conn, &major, &minor) != Success) {
+        fprintf(stderr, "XInput 2.2 not available\n");
+        return false;
+    }
+
+    unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    // raw events of a slave are delivered again for its master, with the
+    // same sourceid; the masters alone see every keystroke once
+    XIEventMask mask = { XIAllMasterDevices, sizeof(mask_bits), mask_bits };
+    XISetMask(mask_bits, XI_RawKeyPress);
+    XISetMask(mask_bits, XI_RawKeyRelease);
+    XISetMask(mask_bits, XI_RawButtonPress);
+    XISetMask(mask_bits, XI_RawButtonRelease);
+    XISelectEvents(app->data_conn, DefaultRootWindow(app->data_conn), &mask, 1);
+    create_wake_window(app);
+    return true;
+}
+
+// Reads raw events from data_conn until sig_handler wakes us. The record
+// context is enabled asynchronously on the same connection, so its data is
+// dispatched to intercept() whenever Xlib reads from the socket here.
+void xi2_loop(App *app) {
+    Display *d = app->data_conn;
+    for (;;) {
+        XEvent ev;
+        XNextEvent(d, &ev);
+        if (ev.type == ClientMessage && ev.xclient.window == app->wake_window) {
+            break;
+        }
+        XGenericEventCookie *cookie = &ev.xcookie;
+        if (cookie->type != GenericEvent || cookie->extension != app->xi_opcode || !XGetEventData(d, cookie)) {
+            continue;
+        }
+        XIRawEvent *raw = cookie->data;
+        RecordedEvent rev = { 0, raw->detail, raw->sourceid, None, { None }, now_ns() };
+        switch (cookie->evtype) {
+            case XI_RawKeyPress: rev.type = KeyPress; break;
+            case XI_RawKeyRelease: rev.type = KeyRelease; break;
+            case XI_RawButtonPress: rev.type = ButtonPress; break;
+            case XI_RawButtonRelease: rev.type = ButtonRelease; break;
+        }
+        if (rev.type != 0 && take_echo(&app->echoes, rev.type, rev.detail, rev.stamp)) {
+            atomic_fetch_add_explicit(&app->own_events, 1, memory_order_relaxed);
+        } else if (rev.type != 0) {
+            push_event(app, &rev);
+        }
+        XFreeEventData(d, cookie);
+    }
+}
+
+// Sets up the evdev backend: grabs the keyboards and creates the uinput
+// keyboard every key is passed on to. Latching is an X request, so -l does
+// not apply here.
+bool init_evdev(App *app) {
+    app->uinput_fd = uinput_open();
+    if (app->uinput_fd < 0) {
+        fprintf(stderr, "Could not create uinput keyboard: %s\n", strerror(errno));
+        return false;
+    }
+    app->nevdev = evdev_open_keyboards(app->evdev_paths, app->nevdev_paths, app->evdev_fds, EVDEV_MAX_DEVICES);
+    if (app->nevdev == 0) {
+        fprintf(stderr, "No keyboard to grab\n");
+        uinput_close(app->uinput_fd);
+        return false;
+    }
+    memset(app->key_down, 0, sizeof(app->key_down));
+    memset(app->key_consumed, 0, sizeof(app->key_consumed));
+    app->latch_mods = false;
+    create_wake_window(app);
+    return true;
+}
+
+// Reads the grabbed keyboards until sig_handler wakes us. The record context
+// runs asynchronously on data_conn and is polled alongside the devices, so
+// this thread stays the only producer on the event ring.
+void evdev_loop(App *app) {
+    Display *d = app->data_conn;
+    struct pollfd fds[EVDEV_MAX_DEVICES + 1];
+    fds[0].fd = ConnectionNumber(d);
+    fds[0].events = POLLIN;
+    for (int i = 0; i < app->nevdev; i++) {
+        fds[i + 1].fd = app->evdev_fds[i];
+        fds[i + 1].events = POLLIN;
+    }
+
+    for (;;) {
+        XRecordProcessReplies(d);
+        while (XPending(d) > 0) {
+            XEvent ev;
+            XNextEvent(d, &ev);
+            if (ev.type == ClientMessage && ev.xclient.window == app->wake_window) {
+                return;
+            }
+        }
+        if (poll(fds, app->nevdev + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            return;
+        }
+        for (int i = 0; i < app->nevdev; i++) {
+            if (!(fds[i + 1].revents & POLLIN)) {
+                continue;
+            }
+            struct input_event events[64];
+            ssize_t len;
+            while ((len = read(app->evdev_fds[i], events, sizeof(events))) > 0) {
+                for (int j = 0; j < len / (ssize_t) sizeof(struct input_event); j++) {
+                    struct input_event *ie = &events[j];
+                    if (ie->type != EV_KEY || ie->code >= 256 - 8) {
+                        continue;
+                    }
+                    // the kernel stamped the event on CLOCK_MONOTONIC
+                    uint64_t stamp = (uint64_t)ie->input_event_sec * 1000000000UL + ie->input_event_usec * 1000UL;
+                    RecordedEvent rev = { ie->value ? KeyPress : KeyRelease, ie->code + 8, i + 1, None, { None }, stamp };
+                    push_event(app, &rev);
+                }
+            }
+        }
+    }
+}
+
+// Record callback. Runs on the data_conn thread and never talks to the
+// server: it only picks out the events we act on and hands a compact copy to
+// the injector thread.
+void intercept(XPointer user_data, XRecordInterceptData *data) {
+    if (data->category != XRecordFromServer) {
+        XRecordFreeData(data);
+        return;
+    }
+
+	App *app = (App*)user_data;
+    uint64_t stamp = now_ns();
+
+	// mangle data
+    XRecordDatum *datum = (XRecordDatum*) data->data;
+    int event_type = datum->event.u.u.type;
+    atomic_fetch_add_explicit(&app->key_event_counts[event_type & (EVENT_TYPE_COUNT - 1)], 1, memory_order_relaxed);
+    RecordedEvent ev = { event_type, 0, 0, None, { None }, stamp };
+    bool wanted = false;
+
+    switch (event_type) {
+        case KeyPress:
+        case KeyRelease:
+        case ButtonPress:
+        case ButtonRelease:
+            ev.detail = datum->event.u.u.detail;
+            wanted = !take_echo(&app->echoes, event_type, ev.detail, stamp);
+            if (!wanted) {
+                atomic_fetch_add_explicit(&app->own_events, 1, memory_order_relaxed);
+            }
+            break;
+        case PropertyNotify:
+            ev.window = datum->event.u.property.window;
+            ev.atom = datum->event.u.property.atom;
+            wanted = ev.atom == XA_WM_CLASS
+                || (ev.window == app->root && ev.atom == app->net_active_window && ev.atom != None);
+            if (wanted && ev.window == app->last_property_window && ev.atom == app->last_property_atom
+                    && datum->event.u.property.time == app->last_property_time) {
+                wanted = false;
+            } else if (wanted) {
+                app->last_property_window = ev.window;
+                app->last_property_atom = ev.atom;
+                app->last_property_time = datum->event.u.property.time;
+            }
+            break;
+        case MappingNotify:
+            wanted = true;
+            break;
+        case FocusIn:
+            // fallback for window managers without _NET_ACTIVE_WINDOW
+            ev.window = datum->event.u.focus.window;
+            ev.detail = datum->event.u.focus.mode;
+            wanted = app->net_active_window == None && ev.window != app->root
+                && (ev.detail == NotifyNormal || ev.detail == NotifyWhileGrabbed);
+            break;
+        default:
+            if (event_type == app->xkb_event_base && datum->event.u.u.detail == XkbNewKeyboardNotify) {
+                ev.type = MappingNotify;
+                wanted = true;
+            }
+            break;
     }
 
-exit:
-	XUnlockDisplay(app->ctrl_conn); 
+    if (wanted) {
+        push_event(app, &ev);
+    }
 	XRecordFreeData(data);
 }
 
+// Record callback of the window context, runs on the window reader.
+void intercept_window(XPointer user_data, XRecordInterceptData *data) {
+    App *app = (App*)user_data;
+    if (data->category == XRecordStartOfData) {
+        mark_window_recording(app);
+    }
+    if (data->category != XRecordFromServer) {
+        XRecordFreeData(data);
+        return;
+    }
+
+    XRecordDatum *datum = (XRecordDatum*) data->data;
+    int event_type = datum->event.u.u.type;
+    atomic_fetch_add_explicit(&app->window_event_counts[event_type & (EVENT_TYPE_COUNT - 1)], 1, memory_order_relaxed);
+    RecordedEvent ev = { event_type, 0, 0, None, { None }, now_ns() };
+    Time time = CurrentTime;
+    bool wanted = false;
+
+    switch (event_type) {
+        case CreateNotify:
+            ev.window = datum->event.u.createNotify.window;
+            ev.parent = datum->event.u.createNotify.parent;
+            wanted = true;
+            break;
+        case ReparentNotify:
+            ev.window = datum->event.u.reparent.window;
+            ev.parent = datum->event.u.reparent.parent;
+            wanted = true;
+            break;
+        case DestroyNotify:
+            ev.window = datum->event.u.destroyNotify.window;
+            wanted = true;
+            break;
+        case PropertyNotify:
+            ev.window = datum->event.u.property.window;
+            ev.atom = datum->event.u.property.atom;
+            time = datum->event.u.property.time;
+            wanted = ev.atom == XA_WM_CLASS
+                || (ev.window == app->root && ev.atom == app->net_client_list && ev.atom != None
+                    && app->backend != BACKEND_EVDEV && !app->lazy_grabs);
+            break;
+    }
+
+    // the copies delivered to the other clients selecting the same window
+    // come back to back and change nothing. Property changes carry their
+    // server time, so two real changes of the same property stay apart
+    const RecordedEvent *last = &app->last_window_event;
+    if (wanted && ev.type == last->type && ev.window == last->window
+            && ev.parent == last->parent && time == app->last_window_time) {
+        wanted = false;
+    }
+    if (wanted) {
+        app->last_window_event = ev;
+        app->last_window_time = time;
+        push_window_event(app, &ev);
+    }
+    XRecordFreeData(data);
+}
+
+void *window_reader(void *user_data) {
+    App *app = (App*)user_data;
+    if (!XRecordEnableContext(app->window_data_conn, app->window_ctx, intercept_window, (XPointer)app)) {
+        fprintf(stderr, "Failed to enable window xrecord context\n");
+        mark_window_recording(app);
+    }
+    return NULL;
+}
+
 int main (int argc, char **argv) {
 	app = malloc(sizeof(App));
 
 	int dummy, ch;
 
-	XRecordRange *rec_range = XRecordAllocRange();
+	XRecordRange *key_ranges[KEY_RANGE_MAX];
+	int nkey_ranges = 0;
+	XRecordRange *struct_range = XRecordAllocRange();
+	XRecordRange *prop_range = XRecordAllocRange();
+	XRecordRange *reparent_range = XRecordAllocRange();
+	XRecordRange *window_ranges[] = { struct_range, reparent_range, prop_range };
 	XRecordClientSpec client_spec = XRecordAllClients;
 
 	app->debug = False;
+	app->latch_mods = false;
+	app->backend = BACKEND_RECORD;
+	app->config_path = NULL;
+	app->nevdev_paths = 0;
+	app->nevdev = 0;
+	memset(&app->inject_stats, 0, sizeof(InjectStats));
+	memset(app->mod_down, 0, sizeof(app->mod_down));
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		hist_init(&app->latency[i]);
+	}
 	app->current = new_hotkey();
+	app->class_cache = new_class_cache();
+	app->grabs = new_grab_registry();
+	app->lazy_grabs = false;
+	app->focused = kh_init(WindowSet);
+
+	// WM_CLASS changes invalidate the class cache and the grabs,
+	// _NET_CLIENT_LIST changes grab new clients
+	prop_range->delivered_events.first = PropertyNotify;
+	prop_range->delivered_events.last = PropertyNotify;
+	app->record_ctx = 0;
+	app->window_ctx = 0;
+	app->last_property_window = None;
+	app->last_property_atom = None;
+	app->last_property_time = CurrentTime;
+	app->record_input = -1;
+	for (int i = 0; i < EVENT_TYPE_COUNT; i++) {
+		atomic_init(&app->key_event_counts[i], 0);
+		atomic_init(&app->window_event_counts[i], 0);
+	}
+	for (int type = 0; type <= ButtonRelease - KeyPress; type++) {
+		for (int code = 0; code < 256; code++) {
+			atomic_init(&app->echoes.pending[type][code], 0);
+			atomic_init(&app->echoes.stamp[type][code], 0);
+		}
+	}
+	atomic_init(&app->own_events, 0);
 
-	rec_range->device_events.first = KeyPress;
-	rec_range->device_events.last = DestroyNotify;
-
-	while ((ch = getopt (argc, argv, "d")) != -1) {
+	while ((ch = getopt (argc, argv, "dlfb:i:c:")) != -1) {
 		switch (ch) {
+			case 'b':
+				if (strcmp(optarg, "record") == 0) {
+					app->backend = BACKEND_RECORD;
+				} else if (strcmp(optarg, "xi2") == 0) {
+					app->backend = BACKEND_XI2;
+				} else if (strcmp(optarg, "evdev") == 0) {
+					app->backend = BACKEND_EVDEV;
+				} else {
+					fprintf(stderr, "Unknown backend '%s'\n", optarg);
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'c':
+				app->config_path = optarg;
+				break;
 			case 'd':
 				app->debug = True;
 				break;
+			case 'i':
+				if (app->nevdev_paths < EVDEV_MAX_DEVICES) {
+					app->evdev_paths[app->nevdev_paths++] = optarg;
+				}
+				break;
+			case 'l':
+				app->latch_mods = true;
+				break;
+			case 'f':
+				app->lazy_grabs = true;
+				break;
 			default:
                 print_usage(argv[0]);
                 return EXIT_SUCCESS;
 		}
 	}
 
+	// CreateNotify, DestroyNotify and ReparentNotify keep the window mirror
+	// current, in lazy mode too so a window focused for the first time
+	// resolves against its real parent chain. They are not device events,
+	// XRecord sees them as they are delivered to the clients selecting them
+	struct_range->delivered_events.first = CreateNotify;
+	struct_range->delivered_events.last = DestroyNotify;
+	reparent_range->delivered_events.first = ReparentNotify;
+	reparent_range->delivered_events.last = ReparentNotify;
+
 	if (optind < argc) {
 		fprintf(stderr, "Not a command line option: '%s'\n", argv[optind]);
 		print_usage (argv[0]);
@@ -614,11 +2321,14 @@ int main (int argc, char **argv) {
 		fprintf(stderr, "Failed to initialize threads.\n");
 		exit (EXIT_FAILURE);
 	}
+	default_error_handler = XSetErrorHandler(grab_error_handler);
 
 	app->data_conn = XOpenDisplay(NULL);
 	app->ctrl_conn = XOpenDisplay(NULL);
+	app->window_data_conn = XOpenDisplay(NULL);
+	app->window_conn = XOpenDisplay(NULL);
 
-	if (!app->data_conn || !app->ctrl_conn) {
+	if (!app->data_conn || !app->ctrl_conn || !app->window_data_conn || !app->window_conn) {
 		fprintf(stderr, "Unable to connect to X11 display. Is $DISPLAY set?\n");
 		exit (EXIT_FAILURE);
 	}
@@ -626,14 +2336,25 @@ int main (int argc, char **argv) {
 		fprintf(stderr, "Xtst extension missing\n");
 		exit (EXIT_FAILURE);
 	}
+	// keep injecting even while another client grabs the server
+	XTestGrabControl(app->ctrl_conn, True);
 	if (!XRecordQueryVersion (app->ctrl_conn, &dummy, &dummy)) {
 		fprintf(stderr, "Failed to obtain xrecord version\n");
 		exit (EXIT_FAILURE);
 	}
-	if (!XkbQueryExtension (app->ctrl_conn, &dummy, &dummy, &dummy, &dummy, &dummy)) {
+	if (!XkbQueryExtension (app->ctrl_conn, &dummy, &app->xkb_event_base, &dummy, &dummy, &dummy)) {
 		fprintf(stderr, "Failed to obtain xkb version\n");
 		exit (EXIT_FAILURE);
 	}
+	XkbSelectEvents(app->ctrl_conn, XkbUseCoreKbd, XkbNewKeyboardNotifyMask, XkbNewKeyboardNotifyMask);
+	build_keymap(app->ctrl_conn, &app->keymap);
+	app->keymap_dirty = false;
+	if (app->backend == BACKEND_XI2 && !init_xi2(app)) {
+		exit (EXIT_FAILURE);
+	}
+	if (app->backend == BACKEND_EVDEV && !init_evdev(app)) {
+		exit (EXIT_FAILURE);
+	}
 
 	if (app->debug != True)
 		daemon (0, 0);
@@ -641,39 +2362,144 @@ int main (int argc, char **argv) {
 	sigemptyset(&app->sigset);
 	sigaddset(&app->sigset, SIGINT);
 	sigaddset(&app->sigset, SIGTERM);
+	sigaddset(&app->sigset, SIGUSR1);
 	pthread_sigmask(SIG_BLOCK, &app->sigset, NULL);
 
 	pthread_create(&app->sigwait_thread, NULL, sig_handler, app);
 
-	app->record_ctx = XRecordCreateContext(app->ctrl_conn, 0, &client_spec, 1, &rec_range, 1);
+	app->events = ring_init(EVENT_RING_SIZE, sizeof(RecordedEvent));
+	app->window_events = ring_init(WINDOW_RING_SIZE, sizeof(RecordedEvent));
+	if (app->events == NULL || app->window_events == NULL) {
+		fprintf(stderr, "Failed to allocate event ring\n");
+		exit (EXIT_FAILURE);
+	}
+	pthread_mutex_init(&app->window_push_lock, NULL);
+	pthread_mutex_init(&app->window_start_lock, NULL);
+	pthread_cond_init(&app->window_started, NULL);
+	app->window_recording = false;
+	app->last_window_event = (RecordedEvent){ 0, 0, 0, None, { None }, 0 };
+	app->last_window_time = CurrentTime;
+
+	atomic_init(&app->epoch, 1);
+	atomic_init(&app->reader_epoch, 0);
+	atomic_init(&app->window_epoch, 0);
+	app->table_generation = 0;
+	app->window_generation = 0;
+	ConfigTable *table = load_config_table(app);
+	if (table == NULL) {
+		// start empty, the watcher picks the file up once it appears
+		table = new_config_table();
+		table->config = kh_init(Config);
+		table->dispatch = compile_dispatch(table->config);
+	}
+	atomic_init(&app->table, table);
+	switch_table(app, table);
+	switch_window_table(app, table);
+	app->mapping_backend = (MappingBackend){ app, x_focus_class_id, x_inject };
+	if (app->backend == BACKEND_EVDEV) {
+		// no grabs, uinput carries the remapped keys
+		app->lazy_grabs = false;
+	}
+	init_window_tracking(app);
+	// in lazy mode this asks the window worker to grab the focused window
+	init_focus_tracking(app);
 
-	if (app->record_ctx == 0) {
+	// the ranges follow the config, so the contexts are created once it is
+	// loaded and the focus atoms are known
+	nkey_ranges = key_record_ranges(app, app->record_input == 1, key_ranges);
+	app->record_ctx = XRecordCreateContext(app->ctrl_conn, 0, &client_spec, 1, key_ranges, nkey_ranges);
+	app->window_ctx = XRecordCreateContext(app->ctrl_conn, 0, &client_spec, 1, window_ranges, 3);
+
+	if (app->record_ctx == 0 || app->window_ctx == 0) {
 		fprintf(stderr, "Failed to create xrecord context\n");
 		exit (EXIT_FAILURE);
 	}
-
-	load_configuration_file(app);
-	grab_all_keys(app);
+	// the window worker starts after the load, until then the ring holds
+	// what changed meanwhile
+	XSync(app->ctrl_conn, False);
+	pthread_create(&app->window_reader_thread, NULL, window_reader, app);
+	load_window_tree(app);
+	if (app->backend != BACKEND_EVDEV && !app->lazy_grabs) {
+		grab_all_keys(app);
+	}
 
 	//XSync(app->ctrl_conn, False);
 	XSync(app->ctrl_conn, True);
+	XSync(app->window_conn, True);
+
+	pthread_create(&app->injector_thread, NULL, injector, app);
+	pthread_create(&app->window_thread, NULL, window_worker, app);
+	app->reload_stop = eventfd(0, EFD_CLOEXEC);
+	pthread_create(&app->reload_thread, NULL, config_watcher, app);
 
-	if (!XRecordEnableContext(app->data_conn, app->record_ctx, intercept, (XPointer)app)) {
+	if (app->backend != BACKEND_RECORD) {
+		if (!XRecordEnableContextAsync(app->data_conn, app->record_ctx, intercept, (XPointer)app)) {
+			fprintf(stderr, "Failed to enable xrecord context\n");
+			exit (EXIT_FAILURE);
+		}
+		if (app->backend == BACKEND_XI2) {
+			xi2_loop(app);
+		} else {
+			evdev_loop(app);
+		}
+	} else if (!XRecordEnableContext(app->data_conn, app->record_ctx, intercept, (XPointer)app)) {
 		fprintf(stderr, "Failed to enable xrecord context\n");
 		exit (EXIT_FAILURE);
 	}
 
 	pthread_join(app->sigwait_thread, NULL);
 
-	if (!XRecordFreeContext (app->ctrl_conn, app->record_ctx)) {
+	uint64_t stop = 1;
+	if (write(app->reload_stop, &stop, sizeof(stop)) < 0) {
+		fprintf(stderr, "Failed to stop config watcher\n");
+	}
+	pthread_join(app->reload_thread, NULL);
+	close(app->reload_stop);
+	pthread_join(app->window_reader_thread, NULL);
+
+	// the injector posts to the window worker, so it stops first
+	ring_close(app->events);
+	pthread_join(app->injector_thread, NULL);
+	ring_close(app->window_events);
+	pthread_join(app->window_thread, NULL);
+	if (app->debug) {
+		fprintf(stderr, "Event ring high water mark %zu of %d\n", ring_high_water(app->events), EVENT_RING_SIZE);
+		fprintf(stderr, "Window ring high water mark %zu of %d\n", ring_high_water(app->window_events), WINDOW_RING_SIZE);
+	}
+	ring_dispose(app->events);
+	ring_dispose(app->window_events);
+	pthread_mutex_destroy(&app->window_push_lock);
+	pthread_mutex_destroy(&app->window_start_lock);
+	pthread_cond_destroy(&app->window_started);
+	if (app->backend == BACKEND_EVDEV) {
+		evdev_close_keyboards(app->evdev_fds, app->nevdev);
+		uinput_close(app->uinput_fd);
+	}
+
+	if (!XRecordFreeContext (app->ctrl_conn, app->record_ctx)
+			|| !XRecordFreeContext (app->ctrl_conn, app->window_ctx)) {
 		fprintf(stderr, "Failed to free xrecord context\n");
 	}
 
-	if (app->debug) fprintf(stderr, "main exiting\n");
-	XFree(rec_range);
+	if (app->debug) {
+		InjectStats *stats = &app->inject_stats;
+		fprintf(stderr, "Issued %lu grabs, %lu ungrabs on %u windows\n", app->grabs->grabs, app->grabs->ungrabs, kh_size(app->grabs->windows));
+		fprintf(stderr, "Injected %lu batches, %lu events, avg %ld us, max %ld us\n", stats->batches, stats->events,
+				stats->batches > 0 ? stats->total_ns / (long)stats->batches / 1000 : 0, stats->max_ns / 1000);
+		dump_event_counts(app);
+		fprintf(stderr, "main exiting\n");
+	}
+	for (int i = 0; i < nkey_ranges; i++) {
+		XFree(key_ranges[i]);
+	}
+	XFree(struct_range);
+	XFree(reparent_range);
+	XFree(prop_range);
 
 	XCloseDisplay(app->ctrl_conn);
 	XCloseDisplay(app->data_conn);
+	XCloseDisplay(app->window_conn);
+	XCloseDisplay(app->window_data_conn);
 	free_app(app);
 	free(app);
 
@@ -681,26 +2507,70 @@ int main (int argc, char **argv) {
 }
 
 void free_app(App *app) {
-    for (khint_t k = kh_begin(app->config); k != kh_end(app->config); ++k) {
-        if (kh_exist(app->config, k)) {
-            khash_t(Mappings)* mapping = kh_value(app->config, k);
-            for (khint_t k2 = kh_begin(mapping); k2 != kh_end(mapping); ++k2) {
-                if (kh_exist(mapping, k2)) {
-                    char * class = kh_key(mapping, k2);
-                    Hotkey *h = kh_value(mapping, k2);
-                    kh_del(Mappings, mapping, k2);
-                    free(class);
-                    free(h);
-                }
-            }
-            kh_del(Config, app->config, k);
-            kh_destroy(Mappings, mapping);
-        }
-    }
-    kh_destroy(Config, app->config);
+    free_config_table(atomic_load(&app->table));
+    free_class_cache(app->class_cache);
+    wintree_free(app->tree);
+    kv_destroy(app->clients);
+    free_grab_registry(app->grabs);
+    kh_destroy(WindowSet, app->focused);
+    free(app->focus_class);
     free(app->current);
 }
 
+// Writes the nonzero counters of one record context on a line, to stderr
+// when running in the foreground and to syslog once daemonized.
+static void dump_counts(App *app, const char *context, atomic_ulong *counts) {
+	char line[1024];
+	int len = snprintf(line, sizeof(line), "%s events:", context);
+	for (int type = 0; type < EVENT_TYPE_COUNT && len < (int)sizeof(line); type++) {
+		unsigned long n = atomic_load_explicit(&counts[type], memory_order_relaxed);
+		if (n == 0) {
+			continue;
+		}
+		if (type < LASTEvent && EVENT_NAMES[type] != NULL) {
+			len += snprintf(line + len, sizeof(line) - len, " %s %lu", EVENT_NAMES[type], n);
+		} else {
+			len += snprintf(line + len, sizeof(line) - len, " type%d %lu", type, n);
+		}
+	}
+	if (app->debug) {
+		fprintf(stderr, "%s\n", line);
+	} else {
+		syslog(LOG_INFO, "%s", line);
+	}
+}
+
+// Reports how many events of each type the key and window contexts saw, and
+// how many of our own injected events were dropped.
+void dump_event_counts(App *app) {
+	dump_counts(app, "key", app->key_event_counts);
+	dump_counts(app, "window", app->window_event_counts);
+	unsigned long own = atomic_load_explicit(&app->own_events, memory_order_relaxed);
+	if (app->debug) {
+		fprintf(stderr, "own events filtered: %lu\n", own);
+	} else {
+		syslog(LOG_INFO, "own events filtered: %lu", own);
+	}
+}
+
+// Writes p50/p90/p99/max of every stage, in microseconds, to stderr when
+// running in the foreground and to syslog once daemonized.
+void dump_latency(App *app) {
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		histogram_t *h = &app->latency[i];
+		char line[160];
+		snprintf(line, sizeof(line), "%-8s n %8lu  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us",
+				STAGE_NAMES[i], (unsigned long)hist_count(h),
+				hist_percentile(h, 0.50) / 1000.0, hist_percentile(h, 0.90) / 1000.0,
+				hist_percentile(h, 0.99) / 1000.0, hist_max(h) / 1000.0);
+		if (app->debug) {
+			fprintf(stderr, "%s\n", line);
+		} else {
+			syslog(LOG_INFO, "%s", line);
+		}
+	}
+}
+
 void *sig_handler(void *user_data) {
 	App *app = (App*)user_data;
 	int sig;
@@ -708,18 +2578,35 @@ void *sig_handler(void *user_data) {
 	if (app->debug)
 	    fprintf(stderr, "sig_handler running...\n");
 
-	sigwait(&app->sigset, &sig);
+	for (;;) {
+		sigwait(&app->sigset, &sig);
+		if (sig != SIGUSR1) {
+			break;
+		}
+		dump_latency(app);
+		dump_event_counts(app);
+	}
 
 	if (app->debug)
 	    fprintf(stderr, "Caught signal %d!\n", sig);
 
 	XLockDisplay(app->ctrl_conn);
 
-	if (!XRecordDisableContext (app->ctrl_conn, app->record_ctx)) {
+	if (!XRecordDisableContext (app->ctrl_conn, app->record_ctx)
+			|| !XRecordDisableContext (app->ctrl_conn, app->window_ctx)) {
 		fprintf(stderr, "Failed to disable xrecord context\n");
 		exit(EXIT_FAILURE);
 	}
 
+	if (app->backend != BACKEND_RECORD) {
+		// an event with no mask goes to the client that created the window
+		XEvent wake = { 0 };
+		wake.xclient.type = ClientMessage;
+		wake.xclient.window = app->wake_window;
+		wake.xclient.format = 32;
+		XSendEvent(app->ctrl_conn, app->wake_window, False, NoEventMask, &wake);
+	}
+
 	XSync(app->ctrl_conn, False);
 	XUnlockDisplay(app->ctrl_conn);
 
@@ -731,6 +2618,12 @@ void *sig_handler(void *user_data) {
 
 
 void print_usage (const char *program_name) {
-	fprintf(stderr, "Usage: %s [-d] [-e <mapping>]\n", program_name);
+	fprintf(stderr, "Usage: %s [-d] [-l] [-f] [-c <config>] [-b record|xi2|evdev] [-i <device>]... [-e <mapping>]\n", program_name);
 	fprintf(stderr, "Runs as a daemon unless -d flag is set\n");
+	fprintf(stderr, "SIGUSR1 dumps per-stage latency percentiles and received event counts (stderr with -d, syslog otherwise)\n");
+	fprintf(stderr, "  -c  configuration file, ~/.config/xremap by default\n");
+	fprintf(stderr, "  -l  latch target modifiers through XKB instead of faking them\n");
+	fprintf(stderr, "  -f  grab keys on a window when it first takes focus, not at creation\n");
+	fprintf(stderr, "  -b  read keys from XRecord (default), XInput2 raw events or evdev\n");
+	fprintf(stderr, "  -i  evdev device to grab, all keyboards when not given\n");
 }
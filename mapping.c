@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapping.h"
+
+Hotkey* new_hotkey() {
+    Hotkey* h = malloc(sizeof(Hotkey));
+    h->mods = 0;
+    h->key = 0;
+    h->button = 0;
+    return h;
+}
+
+Hotkey * int_to_hotkey(unsigned int in) {
+    Hotkey *out = new_hotkey();
+    out->key = in & 0xFF;
+    out->mods = (in >> HOTKEY_MODS_SHIFT) & HOTKEY_MODS_ALL;
+    out->button = (in >> HOTKEY_BUTTON_SHIFT) & 0x7;
+    return out;
+}
+
+unsigned int hotkey_to_int(Hotkey h) {
+    unsigned int out = h.key;
+    out |= (h.mods & HOTKEY_MODS_ALL) << HOTKEY_MODS_SHIFT;
+    out |= (h.button & 0x7) << HOTKEY_BUTTON_SHIFT;
+    return out;
+}
+
+void arena_init(Arena *arena) {
+    arena->head = NULL;
+    arena->interned = kh_init(Interned);
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaChunk *chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        arena->head = chunk;
+    }
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+const char *arena_intern(Arena *arena, const char *s) {
+    khint_t k = kh_get(Interned, arena->interned, s);
+    if (k != kh_end(arena->interned)) {
+        return kh_key(arena->interned, k);
+    }
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(arena, len);
+    memcpy(copy, s, len);
+    int ret;
+    kh_put(Interned, arena->interned, copy, &ret);
+    return copy;
+}
+
+void arena_free(Arena *arena) {
+    while (arena->head != NULL) {
+        ArenaChunk *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    kh_destroy(Interned, arena->interned);
+    arena->interned = NULL;
+}
+
+void free_config(khash_t(Config) *config) {
+    for (khint_t k = kh_begin(config); k != kh_end(config); ++k) {
+        if (kh_exist(config, k)) {
+            kh_destroy(Mappings, kh_value(config, k));
+        }
+    }
+    kh_destroy(Config, config);
+}
+
+void free_config_table(ConfigTable *table) {
+    if (table->config != NULL) {
+        free_config(table->config);
+    }
+    arena_free(&table->arena);
+    free_dispatch(table->dispatch);
+    free(table);
+}
+
+int dispatch_class_id(const Dispatch *dispatch, const char *class) {
+    if (class == NULL) {
+        return DISPATCH_NO_CLASS;
+    }
+    khint_t k = kh_get(ClassIds, dispatch->class_ids, class);
+    return k == kh_end(dispatch->class_ids) ? DISPATCH_NO_CLASS : kh_value(dispatch->class_ids, k);
+}
+
+Dispatch *compile_dispatch(khash_t(Config) *config) {
+    Dispatch *dispatch = calloc(1, sizeof(Dispatch));
+    dispatch->class_ids = kh_init(ClassIds);
+
+    // size everything up front; there are at most 248 keycodes plus 5
+    // buttons, so rows never run out
+    int nbindings = 0;
+    int ntargets = 0;
+    for (khint_t k = kh_begin(config); k != kh_end(config); ++k) {
+        if (kh_exist(config, k)) {
+            Hotkey *from = int_to_hotkey(kh_key(config, k));
+            int column = dispatch_column(from);
+            if (dispatch->key_row[column] == 0) {
+                dispatch->key_row[column] = ++dispatch->nrows;
+            }
+            free(from);
+            nbindings++;
+            ntargets += kh_size(kh_value(config, k));
+        }
+    }
+    if (nbindings > DISPATCH_MAX_BINDINGS) {
+        fprintf(stderr, "Too many hotkeys (%d), only %d are used\n", nbindings, DISPATCH_MAX_BINDINGS);
+    }
+    dispatch->rows = calloc(dispatch->nrows > 0 ? dispatch->nrows : 1, sizeof(*dispatch->rows));
+    dispatch->bindings = malloc(sizeof(Binding) * (nbindings > 0 ? nbindings : 1));
+    dispatch->targets = malloc(sizeof(Target) * (ntargets > 0 ? ntargets : 1));
+
+    for (khint_t k = kh_begin(config); k != kh_end(config); ++k) {
+        if (!kh_exist(config, k) || dispatch->nbindings == DISPATCH_MAX_BINDINGS) {
+            continue;
+        }
+        Hotkey *from = int_to_hotkey(kh_key(config, k));
+        int row = dispatch->key_row[dispatch_column(from)] - 1;
+
+        Binding *b = &dispatch->bindings[dispatch->nbindings];
+        b->any = -1;
+        b->first = dispatch->ntargets;
+        b->count = 0;
+        khash_t(Mappings) *mapping = kh_value(config, k);
+        for (khint_t k2 = kh_begin(mapping); k2 != kh_end(mapping); ++k2) {
+            if (!kh_exist(mapping, k2)) {
+                continue;
+            }
+            const char *class = kh_key(mapping, k2);
+            int class_id = DISPATCH_NO_CLASS;
+            if (strcmp(class, "*") != 0) {
+                int ret;
+                khint_t kc = kh_put(ClassIds, dispatch->class_ids, class, &ret);
+                if (ret != 0) {
+                    kh_value(dispatch->class_ids, kc) = dispatch->nclasses++;
+                }
+                class_id = kh_value(dispatch->class_ids, kc);
+            }
+            Target *t = &dispatch->targets[dispatch->ntargets++];
+            t->class_id = class_id;
+            t->to = *kh_value(mapping, k2);
+            if (class_id == DISPATCH_NO_CLASS) {
+                b->any = t - dispatch->targets;
+            }
+        }
+        // keep the per-class targets contiguous, with the global one first
+        if (b->any > b->first) {
+            Target tmp = dispatch->targets[b->first];
+            dispatch->targets[b->first] = dispatch->targets[b->any];
+            dispatch->targets[b->any] = tmp;
+            b->any = b->first;
+        }
+        if (b->any >= 0) {
+            b->first++;
+        }
+        b->count = dispatch->ntargets - b->first;
+
+        dispatch->rows[row][from->mods & 0xFF] = ++dispatch->nbindings;
+        free(from);
+    }
+    return dispatch;
+}
+
+void free_dispatch(Dispatch *dispatch) {
+    kh_destroy(ClassIds, dispatch->class_ids);
+    if (dispatch->image != NULL) {
+        munmap(dispatch->image, dispatch->image_len);
+    } else {
+        free(dispatch->rows);
+        free(dispatch->bindings);
+        free(dispatch->targets);
+    }
+    free(dispatch);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int save_dispatch_image(const Dispatch *dispatch, const char *path, const DispatchKey *key) {
+    // class names in id order
+    const char **names = calloc(dispatch->nclasses > 0 ? dispatch->nclasses : 1, sizeof(char *));
+    uint64_t names_len = 0;
+    for (khint_t k = kh_begin(dispatch->class_ids); k != kh_end(dispatch->class_ids); ++k) {
+        if (kh_exist(dispatch->class_ids, k)) {
+            names[kh_value(dispatch->class_ids, k)] = kh_key(dispatch->class_ids, k);
+            names_len += strlen(kh_key(dispatch->class_ids, k)) + 1;
+        }
+    }
+
+    DispatchImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DISPATCH_IMAGE_MAGIC;
+    header.version = DISPATCH_IMAGE_VERSION;
+    header.key = *key;
+    header.nrows = dispatch->nrows;
+    header.nbindings = dispatch->nbindings;
+    header.ntargets = dispatch->ntargets;
+    header.nclasses = dispatch->nclasses;
+    header.names_len = names_len;
+    memcpy(header.key_row, dispatch->key_row, sizeof(header.key_row));
+
+    // write a sibling and rename it over, so readers never map half an image
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        free(names);
+        return -1;
+    }
+    int ret = write_all(fd, &header, sizeof(header));
+    if (ret == 0) ret = write_all(fd, dispatch->rows, sizeof(*dispatch->rows) * dispatch->nrows);
+    if (ret == 0) ret = write_all(fd, dispatch->bindings, sizeof(Binding) * dispatch->nbindings);
+    if (ret == 0) ret = write_all(fd, dispatch->targets, sizeof(Target) * dispatch->ntargets);
+    for (int i = 0; i < dispatch->nclasses && ret == 0; i++) {
+        ret = write_all(fd, names[i], strlen(names[i]) + 1);
+    }
+    free(names);
+    if (close(fd) != 0) ret = -1;
+    if (ret == 0) ret = rename(tmp, path);
+    if (ret != 0) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+    }
+    return ret;
+}
+
+// A stale key only means a miss, but a damaged image must not send lookups
+// out of bounds.
+static bool dispatch_image_valid(const Dispatch *dispatch) {
+    for (int i = 0; i < 256; i++) {
+        if (dispatch->key_row[i] > dispatch->nrows) return false;
+    }
+    for (int r = 0; r < dispatch->nrows; r++) {
+        for (int m = 0; m < 256; m++) {
+            if (dispatch->rows[r][m] > dispatch->nbindings) return false;
+        }
+    }
+    for (int i = 0; i < dispatch->nbindings; i++) {
+        const Binding *b = &dispatch->bindings[i];
+        if (b->any >= dispatch->ntargets || b->first < 0 || b->count < 0 || b->first + b->count > dispatch->ntargets) {
+            return false;
+        }
+    }
+    for (int i = 0; i < dispatch->ntargets; i++) {
+        if (dispatch->targets[i].class_id >= dispatch->nclasses) return false;
+    }
+    return true;
+}
+
+Dispatch *load_dispatch_image(const char *path, const DispatchKey *key) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DispatchImageHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t len = st.st_size;
+    char *image = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+
+    const DispatchImageHeader *header = (const DispatchImageHeader *)image;
+    size_t rows_len = (size_t)header->nrows * 256 * sizeof(unsigned short);
+    size_t bindings_len = (size_t)header->nbindings * sizeof(Binding);
+    size_t targets_len = (size_t)header->ntargets * sizeof(Target);
+    if (header->magic != DISPATCH_IMAGE_MAGIC || header->version != DISPATCH_IMAGE_VERSION
+            || memcmp(&header->key, key, sizeof(DispatchKey)) != 0
+            || sizeof(*header) + rows_len + bindings_len + targets_len + header->names_len != len) {
+        munmap(image, len);
+        return NULL;
+    }
+
+    Dispatch *dispatch = calloc(1, sizeof(Dispatch));
+    memcpy(dispatch->key_row, header->key_row, sizeof(dispatch->key_row));
+    char *p = image + sizeof(*header);
+    dispatch->rows = (unsigned short (*)[256])p;
+    dispatch->nrows = header->nrows;
+    p += rows_len;
+    dispatch->bindings = (Binding *)p;
+    dispatch->nbindings = header->nbindings;
+    p += bindings_len;
+    dispatch->targets = (Target *)p;
+    dispatch->ntargets = header->ntargets;
+    p += targets_len;
+
+    // the names point into the image, which stays mapped until free_dispatch
+    dispatch->class_ids = kh_init(ClassIds);
+    const char *name = p;
+    const char *end = p + header->names_len;
+    for (uint32_t i = 0; i < header->nclasses; i++) {
+        const char *nul = name < end ? memchr(name, '\0', end - name) : NULL;
+        if (nul == NULL) {
+            kh_destroy(ClassIds, dispatch->class_ids);
+            free(dispatch);
+            munmap(image, len);
+            return NULL;
+        }
+        int ret;
+        khint_t k = kh_put(ClassIds, dispatch->class_ids, name, &ret);
+        kh_value(dispatch->class_ids, k) = i;
+        name = nul + 1;
+    }
+    dispatch->nclasses = header->nclasses;
+    dispatch->image = image;
+    dispatch->image_len = len;
+    if (!dispatch_image_valid(dispatch)) {
+        free_dispatch(dispatch);
+        return NULL;
+    }
+    return dispatch;
+}
+
+bool mapping_execute(const Dispatch *dispatch, const Hotkey *h, const MappingBackend *backend) {
+    const Binding *binding = dispatch_find(dispatch, h);
+    if (binding == NULL) {
+        return false;
+    }
+    int class_id = binding->any >= 0 ? DISPATCH_NO_CLASS : backend->focus_class_id(backend->ctx);
+    const Target *target = dispatch_target(dispatch, binding, class_id);
+    if (target == NULL) {
+        return false;
+    }
+    backend->inject(backend->ctx, target);
+    return true;
+}
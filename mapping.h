@@ -0,0 +1,219 @@
+#ifndef mapping_h
+#define mapping_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "khash.h"
+
+// Hotkey resolution, kept free of X so it can be driven headless. Keycodes,
+// modifier masks and buttons use the X numbering.
+
+typedef struct {
+    unsigned int mods;
+    unsigned char key;
+    int button;
+} Hotkey;
+
+// Packed hotkey layout: bits 0-7 keycode, 8-15 X modifier mask
+// (ShiftMask..Mod5Mask), 16-18 button.
+#define HOTKEY_MODS_SHIFT 8
+#define HOTKEY_BUTTON_SHIFT 16
+#define HOTKEY_MODS_ALL 0xFF
+
+KHASH_MAP_INIT_STR(Mappings, Hotkey*)
+
+KHASH_MAP_INIT_INT(Config, khash_t(Mappings)*)
+
+KHASH_MAP_INIT_STR(ClassIds, int)
+
+KHASH_SET_INIT_STR(Interned)
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+// Bump allocator owning the class names and target hotkeys of a config.
+// Chunks never move, so pointers stay valid until arena_free. Class names
+// are interned: equal names share one copy.
+typedef struct {
+    ArenaChunk *head;
+    khash_t(Interned) *interned;
+} Arena;
+
+#define DISPATCH_NO_CLASS -1
+#define DISPATCH_MAX_BINDINGS 0xFFFF
+
+typedef struct {
+    int class_id;
+    Hotkey to;
+} Target;
+
+// All remappings of one source hotkey. The global ("*") target, if any, wins
+// over the per-class targets stored in targets[first, first + count).
+typedef struct {
+    int any;
+    int first;
+    int count;
+} Binding;
+
+// Config compiled for lookup by (keycode, modifiers). key_row maps a keycode,
+// or a button number for button-only hotkeys (keycodes below 8 are never
+// used by X), to a row of 256 slots indexed by modifier mask. A slot holds a
+// binding index + 1, or 0 when unmapped.
+typedef struct {
+    unsigned char key_row[256];
+    unsigned short (*rows)[256];
+    int nrows;
+    Binding *bindings;
+    int nbindings;
+    Target *targets;
+    int ntargets;
+    khash_t(ClassIds) *class_ids;
+    int nclasses;
+    // set when rows, bindings, targets and the class names live in a mapped
+    // cache image instead of their own allocations
+    void *image;
+    size_t image_len;
+} Dispatch;
+
+// Everything built from one config file, published as a whole so readers
+// see either the old or the new table. config is NULL when the dispatch was
+// loaded from a cache image.
+typedef struct {
+    unsigned long generation;
+    khash_t(Config) *config;
+    Arena arena;
+    Dispatch *dispatch;
+} ConfigTable;
+
+// What a cached Dispatch image was compiled from: the config file identity
+// and a fingerprint of the keyboard mapping its keysyms were resolved with.
+typedef struct {
+    uint64_t config_mtime_ns;
+    uint64_t config_size;
+    uint64_t config_ino;
+    uint64_t keymap_fingerprint;
+} DispatchKey;
+
+#define DISPATCH_IMAGE_MAGIC 0x314d5258 // "XRM1"
+#define DISPATCH_IMAGE_VERSION 1
+
+// Cache image layout: this header, then nrows rows of 256 slots, the
+// bindings, the targets and finally the class names, NUL-terminated, in
+// class id order.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    DispatchKey key;
+    uint32_t nrows;
+    uint32_t nbindings;
+    uint32_t ntargets;
+    uint32_t nclasses;
+    uint64_t names_len;
+    unsigned char key_row[256];
+} DispatchImageHeader;
+
+// What resolving a hotkey needs from its surroundings: the class of the
+// focused window and a way to send the target. main4.c implements it on top
+// of X, bench/lookup.c with a mock.
+typedef struct {
+    void *ctx;
+    // interned class id of the focused window, DISPATCH_NO_CLASS if unknown
+    int (*focus_class_id)(void *ctx);
+    void (*inject)(void *ctx, const Target *target);
+} MappingBackend;
+
+Hotkey* new_hotkey();
+Hotkey* int_to_hotkey(unsigned int in);
+unsigned int hotkey_to_int(Hotkey h);
+
+// Source hotkeys have a key or a button, never both: add_key rejects the
+// combination.
+static inline int dispatch_column(const Hotkey *h) {
+    return h->key > 0 ? h->key : h->button;
+}
+
+// Finds the binding for the pressed hotkey h: one load from key_row and one
+// from the modifier row. A key pressed while a button is held matches
+// nothing, as no hotkey combines the two.
+static inline const Binding *dispatch_find(const Dispatch *dispatch, const Hotkey *h) {
+    if (h->key > 0 && h->button > 0) {
+        return NULL;
+    }
+    int row = dispatch->key_row[dispatch_column(h)];
+    if (row == 0) {
+        return NULL;
+    }
+    int slot = dispatch->rows[row - 1][h->mods & 0xFF];
+    return slot == 0 ? NULL : &dispatch->bindings[slot - 1];
+}
+
+// Returns the target of binding for the window class class_id, preferring the
+// global target.
+static inline const Target *dispatch_target(const Dispatch *dispatch, const Binding *b, int class_id) {
+    if (b->any >= 0) {
+        return &dispatch->targets[b->any];
+    }
+    if (class_id == DISPATCH_NO_CLASS) {
+        return NULL;
+    }
+    for (int i = b->first; i < b->first + b->count; i++) {
+        if (dispatch->targets[i].class_id == class_id) {
+            return &dispatch->targets[i];
+        }
+    }
+    return NULL;
+}
+
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+// Returns the arena copy of the NUL-terminated s, adding it on first use.
+const char *arena_intern(Arena *arena, const char *s);
+void arena_free(Arena *arena);
+
+// Destroys config. Class names and hotkeys belong to its arena.
+void free_config(khash_t(Config) *config);
+
+void free_config_table(ConfigTable *table);
+
+// Returns the interned id of class, or DISPATCH_NO_CLASS if no mapping
+// mentions it.
+int dispatch_class_id(const Dispatch *dispatch, const char *class);
+
+// Compiles config into a Dispatch. Class names are interned by pointer, so
+// the config must outlive the result.
+Dispatch *compile_dispatch(khash_t(Config) *config);
+
+void free_dispatch(Dispatch *dispatch);
+
+// Writes dispatch to path as a cache image for key. Returns 0 on success, -1
+// with errno set otherwise.
+int save_dispatch_image(const Dispatch *dispatch, const char *path, const DispatchKey *key);
+
+// Maps the cache image at path. Returns NULL when it is missing, damaged or
+// was built for a different key.
+Dispatch *load_dispatch_image(const char *path, const DispatchKey *key);
+
+static inline uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+// Resolves the pressed hotkey h and hands its target to backend. The focused
+// class is only asked for when h has per-class targets. Returns true when h
+// was remapped.
+bool mapping_execute(const Dispatch *dispatch, const Hotkey *h, const MappingBackend *backend);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+
+#include "wintree.h"
+
+static int find_node(const WindowTree *tree, Window w) {
+    khint_t k = kh_get(WindowNodes, tree->index, w);
+    return k == kh_end(tree->index) ? -1 : kh_value(tree->index, k);
+}
+
+static int get_node(WindowTree *tree, Window w) {
+    int idx = find_node(tree, w);
+    if (idx >= 0) {
+        return idx;
+    }
+    if (tree->free >= 0) {
+        idx = tree->free;
+        tree->free = tree->nodes[idx].next_sibling;
+    } else {
+        if (tree->nnodes == tree->cap) {
+            tree->cap = tree->cap ? tree->cap * 2 : 256;
+            tree->nodes = realloc(tree->nodes, tree->cap * sizeof(WindowNode));
+        }
+        idx = tree->nnodes++;
+    }
+    tree->nodes[idx] = (WindowNode){ w, -1, -1, -1, -1 };
+    int ret;
+    khint_t k = kh_put(WindowNodes, tree->index, w, &ret);
+    kh_value(tree->index, k) = idx;
+    return idx;
+}
+
+WindowTree *wintree_new(Window root) {
+    WindowTree *tree = malloc(sizeof(WindowTree));
+    tree->nodes = NULL;
+    tree->nnodes = 0;
+    tree->cap = 0;
+    tree->free = -1;
+    tree->index = kh_init(WindowNodes);
+    pthread_mutex_init(&tree->lock, NULL);
+    tree->root = get_node(tree, root);
+    return tree;
+}
+
+void wintree_free(WindowTree *tree) {
+    kh_destroy(WindowNodes, tree->index);
+    pthread_mutex_destroy(&tree->lock);
+    free(tree->nodes);
+    free(tree);
+}
+
+static void unlink_node(WindowTree *tree, int idx) {
+    WindowNode *n = &tree->nodes[idx];
+    if (n->prev_sibling >= 0) {
+        tree->nodes[n->prev_sibling].next_sibling = n->next_sibling;
+    } else if (n->parent >= 0) {
+        tree->nodes[n->parent].first_child = n->next_sibling;
+    }
+    if (n->next_sibling >= 0) {
+        tree->nodes[n->next_sibling].prev_sibling = n->prev_sibling;
+    }
+    n->parent = n->prev_sibling = n->next_sibling = -1;
+}
+
+static void add_node(WindowTree *tree, Window w, Window parent) {
+    int idx = get_node(tree, w);
+    if (parent == None) {
+        return;
+    }
+    int pidx = get_node(tree, parent);
+    if (tree->nodes[idx].parent == pidx) {
+        return;
+    }
+    unlink_node(tree, idx);
+    WindowNode *p = &tree->nodes[pidx];
+    WindowNode *n = &tree->nodes[idx];
+    n->parent = pidx;
+    n->next_sibling = p->first_child;
+    if (p->first_child >= 0) {
+        tree->nodes[p->first_child].prev_sibling = idx;
+    }
+    p->first_child = idx;
+}
+
+void wintree_add(WindowTree *tree, Window w, Window parent) {
+    pthread_mutex_lock(&tree->lock);
+    add_node(tree, w, parent);
+    pthread_mutex_unlock(&tree->lock);
+}
+
+static void free_subtree(WindowTree *tree, int idx) {
+    int child = tree->nodes[idx].first_child;
+    while (child >= 0) {
+        int next = tree->nodes[child].next_sibling;
+        free_subtree(tree, child);
+        child = next;
+    }
+    kh_del(WindowNodes, tree->index, kh_get(WindowNodes, tree->index, tree->nodes[idx].window));
+    tree->nodes[idx].window = None;
+    tree->nodes[idx].first_child = -1;
+    tree->nodes[idx].next_sibling = tree->free;
+    tree->free = idx;
+}
+
+void wintree_remove(WindowTree *tree, Window w) {
+    pthread_mutex_lock(&tree->lock);
+    int idx = find_node(tree, w);
+    if (idx >= 0 && idx != tree->root) {
+        unlink_node(tree, idx);
+        free_subtree(tree, idx);
+    }
+    pthread_mutex_unlock(&tree->lock);
+}
+
+int wintree_ancestors(WindowTree *tree, Window w, Window *chain, int max) {
+    pthread_mutex_lock(&tree->lock);
+    int idx = find_node(tree, w);
+    int n = 0;
+    while (idx >= 0 && idx != tree->root) {
+        if (n < max) {
+            chain[n++] = tree->nodes[idx].window;
+        }
+        idx = tree->nodes[idx].parent;
+    }
+    pthread_mutex_unlock(&tree->lock);
+    return idx == tree->root ? n : -1;
+}
+
+// One window of a level of wintree_load and the cookie of its reply.
+typedef struct {
+    xcb_window_t win;
+    xcb_query_tree_cookie_t tree;
+} LevelQuery;
+
+void wintree_load(WindowTree *tree, Display *d) {
+    xcb_connection_t *c = XGetXCBConnection(d);
+    int cap = 64;
+    int n = 1;
+    LevelQuery *level = malloc(cap * sizeof(LevelQuery));
+    level[0].win = tree->nodes[tree->root].window;
+
+    XFlush(d);
+    while (n > 0) {
+        for (int i = 0; i < n; i++) {
+            level[i].tree = xcb_query_tree(c, level[i].win);
+        }
+        LevelQuery *next = malloc(cap * sizeof(LevelQuery));
+        int nnext = 0;
+        for (int i = 0; i < n; i++) {
+            xcb_query_tree_reply_t *reply = xcb_query_tree_reply(c, level[i].tree, NULL);
+            if (reply != NULL) {
+                xcb_window_t *children = xcb_query_tree_children(reply);
+                int nchildren = xcb_query_tree_children_length(reply);
+                if (nnext + nchildren > cap) {
+                    while (nnext + nchildren > cap) {
+                        cap *= 2;
+                    }
+                    next = realloc(next, cap * sizeof(LevelQuery));
+                }
+                for (int j = 0; j < nchildren; j++) {
+                    wintree_add(tree, children[j], level[i].win);
+                    next[nnext++].win = children[j];
+                }
+            }
+            free(reply);
+        }
+        free(level);
+        level = next;
+        n = nnext;
+    }
+    free(level);
+}
@@ -0,0 +1,56 @@
+#ifndef wintree_h
+#define wintree_h
+
+#include <pthread.h>
+#include <X11/Xlib.h>
+#include "khash.h"
+
+KHASH_MAP_INIT_INT64(WindowNodes, int)
+
+// One window of the mirror. parent, first_child and the sibling links are
+// indices into WindowTree.nodes, -1 for none. A window whose parent we have
+// not seen yet has parent -1 until a CreateNotify or ReparentNotify places
+// it.
+typedef struct {
+    Window window;
+    int parent;
+    int first_child;
+    int next_sibling;
+    int prev_sibling;
+} WindowNode;
+
+// In-memory copy of the server's window hierarchy, loaded once and then kept
+// current from the structure events of the window record context, so
+// ancestor queries never wait on the server. Freed nodes are chained through
+// next_sibling. Every function takes lock, so one thread can apply events
+// while others query.
+typedef struct {
+    pthread_mutex_t lock;
+    WindowNode *nodes;
+    int nnodes;
+    int cap;
+    int free;
+    int root;
+    khash_t(WindowNodes) *index;
+} WindowTree;
+
+WindowTree *wintree_new(Window root);
+void wintree_free(WindowTree *tree);
+
+// Fills the tree with every window below the root, one pipelined batch of
+// QueryTree requests per level.
+void wintree_load(WindowTree *tree, Display *d);
+
+// Places w under parent, creating either as needed. Covers both CreateNotify
+// and ReparentNotify.
+void wintree_add(WindowTree *tree, Window w, Window parent);
+
+// Drops w and everything below it.
+void wintree_remove(WindowTree *tree, Window w);
+
+// Stores w and its ancestors below the root, nearest first, in chain and
+// returns how many there are. Returns -1 when w is unknown or not connected
+// to the root, and stops at max.
+int wintree_ancestors(WindowTree *tree, Window w, Window *chain, int max);
+
+#endif